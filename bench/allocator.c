@@ -0,0 +1,109 @@
+// Microbenchmarks of ds_allocator
+//
+// Build it with the native block headers, with the portable encoding and
+// with the 28 byte headers of the first version to compare them:
+//
+//     gcc -O2 bench/allocator.c -o allocator
+//     gcc -O2 -DDS_AL_PORTABLE_HEADER bench/allocator.c -o allocator_portable
+//     gcc -O2 -DBENCH_BASELINE_ALLOCATOR bench/allocator.c -o allocator_baseline
+#include <stdio.h>
+#include <time.h>
+#define DS_AL_IMPLEMENTATION
+#include "../ds.h"
+
+#ifdef BENCH_BASELINE_ALLOCATOR
+#include "allocator_baseline.h"
+typedef baseline_allocator bench_allocator;
+#define bench_allocator_init baseline_allocator_init
+#define bench_allocator_alloc baseline_allocator_alloc
+#define bench_allocator_free baseline_allocator_free
+#else
+typedef ds_allocator bench_allocator;
+#define bench_allocator_init ds_allocator_init
+#define bench_allocator_alloc ds_allocator_alloc
+#define bench_allocator_free ds_allocator_free
+#endif
+
+#define ARENA_SIZE (64 << 20)
+#define BLOCKS 2000
+#define ROUNDS 200
+#define SCANS 2000
+
+static uint8_t arena[ARENA_SIZE];
+static void *blocks[BLOCKS];
+
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Allocate BLOCKS blocks and free them in the same order. Every allocation
+// walks the blocks before it, so this is dominated by reading headers.
+double bench_alloc_free(void) {
+    bench_allocator allocator;
+    double start = clock_seconds();
+    for (unsigned int round = 0; round < ROUNDS; round++) {
+        bench_allocator_init(&allocator, arena, ARENA_SIZE);
+        for (unsigned int i = 0; i < BLOCKS; i++) {
+            blocks[i] = bench_allocator_alloc(&allocator, 64);
+            if (blocks[i] == NULL) {
+                DS_PANIC("arena too small");
+            }
+        }
+        for (unsigned int i = 0; i < BLOCKS; i++) {
+            bench_allocator_free(&allocator, blocks[i]);
+        }
+    }
+
+    return (clock_seconds() - start) * 1e9 / (ROUNDS * BLOCKS * 2.0);
+}
+
+// Bytes that a 64 byte allocation takes on top of its data
+unsigned int header_bytes(void) {
+    bench_allocator allocator;
+    bench_allocator_init(&allocator, arena, ARENA_SIZE);
+    for (unsigned int i = 0; i < BLOCKS; i++) {
+        bench_allocator_alloc(&allocator, 64);
+    }
+
+    return (unsigned int)((allocator.top - arena) / BLOCKS) - 64;
+}
+
+// Leave BLOCKS / 2 free holes that are too small between live blocks, then
+// make allocations that have to skip all of them
+double bench_first_fit(void) {
+    bench_allocator allocator;
+    bench_allocator_init(&allocator, arena, ARENA_SIZE);
+    for (unsigned int i = 0; i < BLOCKS; i++) {
+        blocks[i] = bench_allocator_alloc(&allocator, 32);
+    }
+    for (unsigned int i = 0; i < BLOCKS; i += 2) {
+        bench_allocator_free(&allocator, blocks[i]);
+    }
+
+    uint64_t visited = 0;
+    double start = clock_seconds();
+    for (unsigned int i = 0; i < SCANS; i++) {
+        if (bench_allocator_alloc(&allocator, 256) == NULL) {
+            DS_PANIC("arena too small");
+        }
+        visited += BLOCKS + i;
+    }
+
+    return (clock_seconds() - start) * 1e9 / visited;
+}
+
+int main(void) {
+#if defined(BENCH_BASELINE_ALLOCATOR)
+    const char *headers = "baseline";
+#elif defined(DS_AL_PORTABLE_HEADER)
+    const char *headers = "portable";
+#else
+    const char *headers = "native";
+#endif
+
+    printf("%s headers (%u B): alloc/free in order %.1f ns/op, first-fit scan %.2f ns/block\n",
+           headers, header_bytes(), bench_alloc_free(), bench_first_fit());
+    return 0;
+}
@@ -0,0 +1,248 @@
+// The ds_allocator of the first version of ds.h, before the block headers
+// were shrunk and read natively: 28 byte headers with prev and next offsets,
+// every field encoded byte by byte. bench/allocator.c includes it when it is
+// built with -DBENCH_BASELINE_ALLOCATOR, to compare the layouts.
+//
+// It is kept as it was, only renamed so that it can sit next to ds.h.
+#ifndef BENCH_BASELINE_ALLOCATOR_H
+#define BENCH_BASELINE_ALLOCATOR_H
+
+#include <stdint.h>
+
+typedef struct baseline_allocator {
+        uint8_t *start;
+        uint8_t *prev;
+        uint8_t *top;
+        uint64_t size;
+} baseline_allocator;
+
+static void baseline_uint64_read_le(uint8_t *data, uint64_t *value) {
+    *value = ((uint64_t)data[0] << 0) | ((uint64_t)data[1] << 8) |
+             ((uint64_t)data[2] << 16) | ((uint64_t)data[3] << 24) |
+             ((uint64_t)data[4] << 32) | ((uint64_t)data[5] << 40) |
+             ((uint64_t)data[6] << 48) | ((uint64_t)data[7] << 56);
+}
+
+static void baseline_uint64_write_le(uint8_t *data, uint64_t value) {
+    data[0] = (value >> 0) & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+    data[4] = (value >> 32) & 0xff;
+    data[5] = (value >> 40) & 0xff;
+    data[6] = (value >> 48) & 0xff;
+    data[7] = (value >> 56) & 0xff;
+}
+
+static void baseline_uint32_read_le(uint8_t *data, uint32_t *value) {
+    *value = ((uint32_t)data[0] << 0) | ((uint32_t)data[1] << 8) |
+             ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void baseline_uint32_write_le(uint8_t *data, uint32_t value) {
+    data[0] = (value >> 0) & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+}
+
+#define BASELINE_BLOCK_METADATA_SIZE 28
+#define BASELINE_BLOCK_INDEX_UNDEFINED -1
+
+/*
+ * | prev | next | size | free | ... size bytes of data ... |
+ */
+typedef struct baseline_block {
+        int64_t prev;  // 8 bytes
+        int64_t next;  // 8 bytes
+        uint64_t size; // 8 bytes
+        uint32_t free; // 4 bytes
+        uint8_t *data; // 8 bytes
+} baseline_block;
+
+static void baseline_block_read(uint8_t *data, baseline_block *block) {
+    baseline_uint64_read_le(data + 0, (uint64_t *)&block->prev);
+    baseline_uint64_read_le(data + 8, (uint64_t *)&block->next);
+    baseline_uint64_read_le(data + 16, &block->size);
+    baseline_uint32_read_le(data + 24, &block->free);
+    block->data = data + BASELINE_BLOCK_METADATA_SIZE;
+}
+
+static void baseline_block_write(uint8_t *data, baseline_block *block) {
+    baseline_uint64_write_le(data + 0, block->prev);
+    baseline_uint64_write_le(data + 8, block->next);
+    baseline_uint64_write_le(data + 16, block->size);
+    baseline_uint32_write_le(data + 24, block->free);
+}
+
+// Initialize the allocator
+//
+// The start parameter is the start of the memory block to allocate from, and
+// the size parameter is the maximum size of the memory allocator.
+static void baseline_allocator_init(baseline_allocator *allocator, uint8_t *start,
+                              uint64_t size) {
+    allocator->start = start;
+    allocator->prev = NULL;
+    allocator->top = start;
+    allocator->size = size;
+}
+
+static int baseline_allocator_find_block(baseline_allocator *allocator, uint64_t size,
+                                baseline_block *block) {
+    if (allocator->prev == NULL) {
+        return 0;
+    }
+
+    baseline_block current = {0};
+    uint8_t *ptr = allocator->start;
+
+    while (ptr < allocator->top) {
+        baseline_block_read(ptr, &current);
+
+        if (current.free && current.size >= size + BASELINE_BLOCK_METADATA_SIZE * 2) {
+            uint64_t old_size = current.size;
+            int64_t old_next = current.next;
+
+            baseline_block split = {0};
+            split.prev = (uint64_t)(ptr - allocator->start);
+            split.next = old_next;
+            split.size = old_size - size - BASELINE_BLOCK_METADATA_SIZE;
+            split.free = 1;
+            split.data = ptr + BASELINE_BLOCK_METADATA_SIZE + size + BASELINE_BLOCK_METADATA_SIZE;
+
+            baseline_block_write(ptr + BASELINE_BLOCK_METADATA_SIZE + size, &split);
+
+            *block = current;
+            block->next =
+                (uint64_t)(ptr - allocator->start) + BASELINE_BLOCK_METADATA_SIZE + size;
+            block->size = size;
+            block->free = 0;
+            block->data = ptr + BASELINE_BLOCK_METADATA_SIZE;
+
+            baseline_block_write(ptr, block);
+
+            baseline_block next = {0};
+            baseline_block_read(allocator->start + old_next, &next);
+
+            next.prev =
+                (uint64_t)(ptr - allocator->start) + BASELINE_BLOCK_METADATA_SIZE + size;
+
+            baseline_block_write(allocator->start + old_next, &next);
+
+            return 1;
+        }
+
+        if (current.free && current.size >= size) {
+            *block = current;
+            block->free = 0;
+
+            baseline_block_write(ptr, block);
+
+            return 1;
+        }
+
+        ptr += (current.size + BASELINE_BLOCK_METADATA_SIZE);
+    }
+
+    return 0;
+}
+
+// Allocate memory from the allocator
+//
+// This function allocates memory from the allocator. If the allocator is unable
+// to allocate the memory, it returns NULL.
+static void *baseline_allocator_alloc(baseline_allocator *allocator, uint64_t size) {
+    baseline_block block = {0};
+    if (baseline_allocator_find_block(allocator, size, &block) != 0) {
+        return block.data;
+    }
+
+    if (allocator->top + size + BASELINE_BLOCK_METADATA_SIZE >
+        allocator->start + allocator->size) {
+        return NULL;
+    }
+
+    block.next = BASELINE_BLOCK_INDEX_UNDEFINED;
+    block.size = size;
+    block.free = 0;
+    block.data = allocator->top + BASELINE_BLOCK_METADATA_SIZE;
+
+    if (allocator->prev == NULL) {
+        block.prev = BASELINE_BLOCK_INDEX_UNDEFINED;
+    } else {
+        block.prev = (uint64_t)(allocator->prev - allocator->start);
+
+        baseline_block prev = {0};
+        baseline_block_read(allocator->prev, &prev);
+        prev.next = (uint64_t)(allocator->top - allocator->start);
+
+        baseline_block_write(allocator->prev, &prev);
+    }
+
+    baseline_block_write(allocator->top, &block);
+
+    allocator->prev = allocator->top;
+    allocator->top += size + BASELINE_BLOCK_METADATA_SIZE;
+
+    return block.data;
+}
+
+// Free memory from the allocator
+//
+// This function frees memory from the allocator. If the pointer is not within
+// the bounds of the allocator, it does nothing.
+static void baseline_allocator_free(baseline_allocator *allocator, void *ptr) {
+    if ((uint8_t *)ptr > allocator->top || (uint8_t *)ptr < allocator->start) {
+        return;
+    }
+
+    baseline_block block = {0};
+    baseline_block_read(ptr - BASELINE_BLOCK_METADATA_SIZE, &block);
+    block.free = 1;
+
+    if (block.prev != BASELINE_BLOCK_INDEX_UNDEFINED) {
+        baseline_block prev = {0};
+        baseline_block_read(allocator->start + block.prev, &prev);
+
+        if (prev.free) {
+            prev.next = block.next;
+            prev.size += block.size + BASELINE_BLOCK_METADATA_SIZE;
+
+            uint8_t *mptr = allocator->start + block.prev;
+
+            baseline_block next = {0};
+            baseline_block_read(allocator->start + block.next, &next);
+
+            next.prev = (uint64_t)((uint8_t *)mptr - allocator->start);
+
+            baseline_block_write(allocator->start + block.next, &next);
+            baseline_block_write(allocator->start + block.prev, &prev);
+
+            block = prev;
+            ptr = mptr + BASELINE_BLOCK_METADATA_SIZE;
+        }
+    }
+
+    if (block.next != BASELINE_BLOCK_INDEX_UNDEFINED) {
+        baseline_block next = {0};
+        baseline_block_read(allocator->start + block.next, &next);
+
+        if (next.free) {
+            baseline_block next_next = {0};
+            baseline_block_read(allocator->start + next.next, &next_next);
+
+            uint8_t *mptr = ptr - BASELINE_BLOCK_METADATA_SIZE;
+
+            next_next.prev = (uint64_t)((uint8_t *)mptr - allocator->start);
+
+            baseline_block_write(allocator->start + next.next, &next_next);
+
+            block.next = next.next;
+            block.size += next.size + BASELINE_BLOCK_METADATA_SIZE;
+        }
+    }
+
+    baseline_block_write(ptr - BASELINE_BLOCK_METADATA_SIZE, &block);
+}
+
+#endif // BENCH_BASELINE_ALLOCATOR_H
@@ -0,0 +1,196 @@
+// Multithreaded stress test of the concurrent ds_allocator
+//
+//     gcc -O2 bench/allocator_threads.c -o allocator_threads -lpthread
+//
+// THREADS threads allocate blocks of random sizes, most of them small enough
+// for the thread caches and some large ones that go to the shared block. Every
+// other block is handed to the next thread through a ring and freed there, or
+// freed by its owner when the ring is full, so up to half of the frees cross
+// threads. Every block is stamped with its owner and checked before it is
+// freed. The same run is timed against malloc.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#define DS_AL_IMPLEMENTATION
+#include "../ds.h"
+
+#define ARENA_SIZE (64 << 20)
+#define THREADS 4
+#define OPS 200000   // allocations per thread
+#define LIVE 256     // blocks a thread keeps alive, a power of two
+#define RING 1024    // blocks in flight between two threads, a power of two
+#define LARGE 8192   // size of the blocks that bypass the thread caches
+
+static uint8_t arena[ARENA_SIZE];
+
+typedef struct ring {
+    void *items[RING];
+    uint64_t head; // the consumer takes from here
+    uint64_t tail; // the producer pushes here
+} ring;
+
+typedef struct stress {
+    void *(*alloc)(uint64_t size);
+    void (*free)(void *ptr);
+    ring rings[THREADS]; // ring i carries the blocks that thread i frees
+    pthread_barrier_t start;
+    uint64_t cross_frees;
+} stress;
+
+typedef struct worker {
+    stress *s;
+    unsigned int index;
+    uint64_t random;
+} worker;
+
+static ds_allocator allocator;
+
+void *arena_alloc(uint64_t size) { return ds_allocator_alloc(&allocator, size); }
+void arena_free(void *ptr) { ds_allocator_free(&allocator, ptr); }
+void *heap_alloc(uint64_t size) { return malloc(size); }
+void heap_free(void *ptr) { free(ptr); }
+
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t random_next(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// | tag | size | ... | last byte of the tag |, blocks are at least 24 bytes
+void stamp(uint8_t *block, uint64_t tag, uint64_t size) {
+    memcpy(block, &tag, sizeof(tag));
+    memcpy(block + 8, &size, sizeof(size));
+    block[size - 1] = (uint8_t)tag;
+}
+
+void check(uint8_t *block) {
+    uint64_t tag;
+    uint64_t size;
+    memcpy(&tag, block, sizeof(tag));
+    memcpy(&size, block + 8, sizeof(size));
+    if (size < 24 || size > LARGE || block[size - 1] != (uint8_t)tag) {
+        DS_PANIC("block %p of thread %u was corrupted", (void *)block,
+                 (unsigned int)(tag >> 32));
+    }
+}
+
+int ring_push(ring *r, void *ptr) {
+    uint64_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING) {
+        return 1;
+    }
+    r->items[tail & (RING - 1)] = ptr;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Check and free the blocks that the previous thread handed over
+uint64_t ring_drain(stress *s, ring *r) {
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    for (uint64_t i = head; i < tail; i++) {
+        check(r->items[i & (RING - 1)]);
+        s->free(r->items[i & (RING - 1)]);
+    }
+    __atomic_store_n(&r->head, tail, __ATOMIC_RELEASE);
+    return tail - head;
+}
+
+void *stress_thread(void *arg) {
+    worker *w = (worker *)arg;
+    stress *s = w->s;
+    ring *inbox = &s->rings[w->index];
+    ring *outbox = &s->rings[(w->index + 1) % THREADS];
+    uint8_t *live[LIVE] = {0};
+    uint64_t cross_frees = 0;
+
+    pthread_barrier_wait(&s->start);
+    for (uint64_t op = 0; op < OPS; op++) {
+        uint64_t r = random_next(&w->random);
+        uint64_t size = (r & 63) == 0 ? LARGE : 24 + (r >> 8) % 2025;
+        uint8_t *block = s->alloc(size);
+        if (block == NULL) {
+            DS_PANIC("arena too small");
+        }
+        stamp(block, ((uint64_t)w->index << 32) | op, size);
+
+        uint8_t **slot = &live[op & (LIVE - 1)];
+        if (*slot != NULL) {
+            check(*slot);
+            if ((op & 1) == 0 || ring_push(outbox, *slot) != 0) {
+                s->free(*slot);
+            }
+        }
+        *slot = block;
+
+        cross_frees += ring_drain(s, inbox);
+    }
+
+    for (unsigned int i = 0; i < LIVE; i++) {
+        if (live[i] != NULL) {
+            check(live[i]);
+            s->free(live[i]);
+        }
+    }
+
+    // The next thread may still be pushing, wait for everyone before the
+    // last drain
+    pthread_barrier_wait(&s->start);
+    cross_frees += ring_drain(s, inbox);
+    __atomic_add_fetch(&s->cross_frees, cross_frees, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+double run(stress *s) {
+    pthread_t threads[THREADS];
+    worker workers[THREADS];
+
+    memset(s->rings, 0, sizeof(s->rings));
+    s->cross_frees = 0;
+    pthread_barrier_init(&s->start, NULL, THREADS + 1);
+    for (unsigned int i = 0; i < THREADS; i++) {
+        workers[i] = (worker){ .s = s, .index = i, .random = 0x9e3779b97f4a7c15ULL * (i + 1) };
+        if (pthread_create(&threads[i], NULL, stress_thread, &workers[i]) != 0) {
+            DS_PANIC("failed to start a thread");
+        }
+    }
+
+    double start = clock_seconds();
+    pthread_barrier_wait(&s->start);
+    pthread_barrier_wait(&s->start);
+    for (unsigned int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = clock_seconds() - start;
+    pthread_barrier_destroy(&s->start);
+
+    return elapsed * 1e9 / ((double)THREADS * OPS);
+}
+
+int main(void) {
+    static stress s;
+
+    ds_allocator_init_concurrent(&allocator, arena, ARENA_SIZE);
+    s.alloc = arena_alloc;
+    s.free = arena_free;
+    double arena_ns = run(&s);
+    uint64_t arena_cross = s.cross_frees;
+
+    s.alloc = heap_alloc;
+    s.free = heap_free;
+    double heap_ns = run(&s);
+
+    printf("%d threads, %d allocations each, %lu freed by another thread\n", THREADS, OPS,
+           (unsigned long)arena_cross);
+    printf("concurrent ds_allocator %.1f ns/op, malloc %.1f ns/op\n", arena_ns, heap_ns);
+    return 0;
+}
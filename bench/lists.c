@@ -0,0 +1,142 @@
+// Throughput of ds_linked_list against ds_unrolled_list and ds_intrusive_list
+//
+//     gcc -O2 bench/lists.c -o lists
+//
+// Each list gets ITEMS ints pushed to the back, is traversed TRAVERSALS times
+// and is emptied from the front. The times are per item.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#define DS_LL_IMPLEMENTATION
+#include "../ds.h"
+
+#define ITEMS 1000000
+#define TRAVERSALS 10
+
+typedef struct thing {
+    int value;
+    ds_intrusive_list_node link;
+} thing;
+
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char *name, double push, double traverse, double pop, long sum) {
+    printf("%-10s push_back %6.2f ns  traverse %6.2f ns  pop_front %6.2f ns  (sum %ld)\n",
+           name, push * 1e9 / ITEMS, traverse * 1e9 / ITEMS / TRAVERSALS, pop * 1e9 / ITEMS,
+           sum);
+}
+
+void bench_linked(void) {
+    ds_linked_list ll;
+    ds_linked_list_init(&ll, sizeof(int));
+
+    double start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        if (ds_linked_list_push_back(&ll, &i) != 0) {
+            DS_PANIC("buy more ram");
+        }
+    }
+    double push = clock_seconds() - start;
+
+    long sum = 0;
+    start = clock_seconds();
+    for (int round = 0; round < TRAVERSALS; round++) {
+        for (ds_linked_list_node *node = ll.head; node != NULL; node = node->next) {
+            sum += *(int *)node->item;
+        }
+    }
+    double traverse = clock_seconds() - start;
+
+    start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        int item;
+        ds_linked_list_pop_front(&ll, &item);
+    }
+    double pop = clock_seconds() - start;
+
+    report("linked", push, traverse, pop, sum);
+    ds_linked_list_free(&ll);
+}
+
+void bench_unrolled(void) {
+    ds_unrolled_list ul;
+    ds_unrolled_list_init(&ul, sizeof(int));
+
+    double start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        if (ds_unrolled_list_push_back(&ul, &i) != 0) {
+            DS_PANIC("buy more ram");
+        }
+    }
+    double push = clock_seconds() - start;
+
+    long sum = 0;
+    start = clock_seconds();
+    for (int round = 0; round < TRAVERSALS; round++) {
+        ds_unrolled_list_iterator it;
+        ds_unrolled_list_iterator_init(&ul, &it);
+        void *item;
+        while (ds_unrolled_list_iterator_next(&it, &item) == 0) {
+            sum += *(int *)item;
+        }
+    }
+    double traverse = clock_seconds() - start;
+
+    start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        int item;
+        ds_unrolled_list_pop_front(&ul, &item);
+    }
+    double pop = clock_seconds() - start;
+
+    report("unrolled", push, traverse, pop, sum);
+    ds_unrolled_list_free(&ul);
+}
+
+// The things are allocated up front, like the structs that embed the links
+// would be in a program
+void bench_intrusive(void) {
+    thing *things = malloc(ITEMS * sizeof(thing));
+    if (things == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    ds_intrusive_list il;
+    ds_intrusive_list_init(&il);
+
+    double start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        things[i].value = i;
+        ds_intrusive_list_push_back(&il, &things[i].link);
+    }
+    double push = clock_seconds() - start;
+
+    long sum = 0;
+    start = clock_seconds();
+    for (int round = 0; round < TRAVERSALS; round++) {
+        for (ds_intrusive_list_node *node = il.head.next; node != &il.head;
+             node = node->next) {
+            sum += ds_container_of(node, thing, link)->value;
+        }
+    }
+    double traverse = clock_seconds() - start;
+
+    start = clock_seconds();
+    for (int i = 0; i < ITEMS; i++) {
+        ds_intrusive_list_pop_front(&il);
+    }
+    double pop = clock_seconds() - start;
+
+    report("intrusive", push, traverse, pop, sum);
+    free(things);
+}
+
+int main(void) {
+    bench_linked();
+    bench_unrolled();
+    bench_intrusive();
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Throughput of the string slice scans in GB/s
+//
+//     gcc -O2 bench/scan.c -o scan
+//     gcc -O2 -DDS_SS_NO_AVX2 bench/scan.c -o scan_sse2
+//     gcc -O2 -DDS_SS_NO_SIMD bench/scan.c -o scan_scalar
+//     ./scan [megabytes of the large input, default 100]
+//
+// The scans are first checked against memchr and a naive count on random
+// input. Then ds_string_slice_tokenize and ds_string_slice_count are timed on
+// 80 byte rows that stay in cache and on a large input of 10 KB rows, like a
+// big map file. Every time is the best of REPEATS runs.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#define DS_SS_IMPLEMENTATION
+#include "../ds.h"
+
+#define REPEATS 5
+#define CHECKS 20000
+#define HOT_BYTES (256 << 10)
+#define HOT_ROUNDS 400
+
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compare find, count and tokenize with the obvious implementations
+int check(void) {
+    char buffer[300];
+    srand(1);
+    for (unsigned int i = 0; i < CHECKS; i++) {
+        unsigned int length = rand() % sizeof(buffer);
+        unsigned int lines = 0;
+        for (unsigned int j = 0; j < length; j++) {
+            buffer[j] = rand() % 40 == 0 ? '\n' : (char)(rand() % 256);
+            lines += buffer[j] == '\n';
+        }
+
+        ds_string_slice slice;
+        ds_string_slice_init(&slice, buffer, length);
+        if (ds_string_slice_count(&slice, '\n') != lines) {
+            return 1;
+        }
+
+        unsigned int index = 0;
+        int result = ds_string_slice_find(&slice, '\n', &index);
+        const char *found = memchr(buffer, '\n', length);
+        if ((found == NULL) != (result != 0) ||
+            (found != NULL && index != (unsigned int)(found - buffer))) {
+            return 1;
+        }
+
+        ds_string_slice token;
+        unsigned int tokens = 0;
+        while (ds_string_slice_tokenize(&slice, '\n', &token) == 0) {
+            tokens++;
+        }
+        unsigned int expected = length == 0 ? 0 : lines + (buffer[length - 1] != '\n');
+        if (tokens != expected) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Fill the buffer with rows of width bytes followed by a line break
+void fill_rows(char *buffer, unsigned int length, unsigned int width) {
+    for (unsigned int i = 0; i < length; i++) {
+        buffer[i] = i % (width + 1) == width ? '\n' : '.';
+    }
+}
+
+// Best time of tokenizing the buffer rounds times
+double time_tokenize(char *buffer, unsigned int length, unsigned int rounds) {
+    double best = 1e9;
+    for (unsigned int repeat = 0; repeat < REPEATS; repeat++) {
+        unsigned int tokens = 0;
+        double start = clock_seconds();
+        for (unsigned int round = 0; round < rounds; round++) {
+            ds_string_slice slice;
+            ds_string_slice token;
+            ds_string_slice_init(&slice, buffer, length);
+            while (ds_string_slice_tokenize(&slice, '\n', &token) == 0) {
+                tokens++;
+            }
+        }
+        double elapsed = clock_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+        if (tokens == 0) {
+            DS_PANIC("no tokens");
+        }
+    }
+
+    return best;
+}
+
+// Best time of counting the line breaks of the buffer rounds times
+double time_count(char *buffer, unsigned int length, unsigned int rounds) {
+    double best = 1e9;
+    for (unsigned int repeat = 0; repeat < REPEATS; repeat++) {
+        unsigned int lines = 0;
+        double start = clock_seconds();
+        for (unsigned int round = 0; round < rounds; round++) {
+            ds_string_slice slice;
+            ds_string_slice_init(&slice, buffer, length);
+            lines += ds_string_slice_count(&slice, '\n');
+        }
+        double elapsed = clock_seconds() - start;
+        best = elapsed < best ? elapsed : best;
+        if (lines == 0) {
+            DS_PANIC("no line breaks");
+        }
+    }
+
+    return best;
+}
+
+int main(int argc, char **argv) {
+#if defined(DS_SS_NO_SIMD)
+    const char *scan = "scalar";
+#elif defined(DS_SS_NO_AVX2)
+    const char *scan = "sse2";
+#else
+    const char *scan = "default";
+#endif
+
+    if (check() != 0) {
+        DS_LOG_ERROR("the %s scan does not match memchr", scan);
+        return 1;
+    }
+
+    unsigned int megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 100;
+    unsigned int length = megabytes << 20;
+    char *large = malloc(length);
+    char *hot = malloc(HOT_BYTES);
+    if (large == NULL || hot == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    fill_rows(large, length, 10000);
+    fill_rows(hot, HOT_BYTES, 80);
+
+    double hot_bytes = (double)HOT_BYTES * HOT_ROUNDS;
+    char label[64];
+    printf("%s scan\n", scan);
+    printf("  %-34s %6.2f GB/s\n", "tokenize, 80 B rows (256 KiB)",
+           hot_bytes / time_tokenize(hot, HOT_BYTES, HOT_ROUNDS) / 1e9);
+    printf("  %-34s %6.2f GB/s\n", "count (256 KiB)",
+           hot_bytes / time_count(hot, HOT_BYTES, HOT_ROUNDS) / 1e9);
+    snprintf(label, sizeof(label), "tokenize, 10 KB rows (%u MiB)", megabytes);
+    printf("  %-34s %6.2f GB/s\n", label, length / time_tokenize(large, length, 1) / 1e9);
+    snprintf(label, sizeof(label), "count (%u MiB)", megabytes);
+    printf("  %-34s %6.2f GB/s\n", label, length / time_count(large, length, 1) / 1e9);
+
+    free(large);
+    free(hot);
+    return 0;
+}
@@ -15,14 +15,21 @@
 // implementation of the string builder utility
 // - DS_SS_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the string slice utility
+// - DS_SS_NO_SIMD: Scan string slices one byte at a time instead of using
+// SSE2 or AVX2
+// - DS_SS_NO_AVX2: Never use AVX2 to scan string slices, not even when the
+// CPU supports it
 // - DS_DA_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the dynamic array data structure
 // - DS_LL_IMPLEMENTATION: Define this macro in one source file to include the
-// implementation of the linked list data structure
+// implementation of the linked list data structures (doubly, unrolled and
+// intrusive)
 // - DS_HT_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the hash table data structure
 // - DS_AL_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the allocator utility and set the allocator to use
+// - DS_AL_PORTABLE_HEADER: Always encode the allocator block headers byte by
+// byte, even on little endian hosts where they are accessed natively
 // - DS_AP_IMPLEMENTATION: Define this macro in one source file to include the
 // implementation of the ds_argument parser utility
 // - DS_IO_IMPLEMENTATION: Define this macro for some io utils
@@ -36,6 +43,10 @@
 //
 // Options:
 // - DS_NO_STDLIB: Disables the use of the standard library
+// - DS_AL_STATS: Routes DS_MALLOC, DS_REALLOC and DS_FREE through an
+// instrumentation layer that records live and peak bytes, per call-site
+// counters and allocations per tick. When it is not defined the macros are
+// left untouched and the layer costs nothing.
 //
 // LOGGING
 //
@@ -60,6 +71,7 @@
 #define DS_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // TODO: rework the hash table to actually work
@@ -77,18 +89,82 @@
 // The allocator is a simple utility to allocate and free memory. You can define
 // the allocator to use when allocating and freeing memory. This can be used in
 // all the other data structures and utilities to use a custom allocator.
+//
+// An allocator initialized with ds_allocator_init_concurrent can be shared by
+// multiple threads. Small allocations are served from per-thread caches of
+// free blocks, one per size class, that are refilled in batches from the
+// shared memory block. Blocks freed by a thread other than the one that owns
+// them are handed back through a lock-free list. Larger allocations go to the
+// shared memory block under a lock.
+#ifndef DS_AL_MAX_THREAD_CACHES
+#define DS_AL_MAX_THREAD_CACHES 8
+#endif
+
 typedef struct ds_allocator {
         uint8_t *start;
         uint8_t *prev;
         uint8_t *top;
         uint64_t size;
+        struct ds_allocator_shared *shared;
 } ds_allocator;
 
 DSHDEF void ds_allocator_init(ds_allocator *allocator, uint8_t *start,
                               uint64_t size);
+DSHDEF void ds_allocator_init_concurrent(ds_allocator *allocator,
+                                         uint8_t *start, uint64_t size);
 DSHDEF void ds_allocator_dump(ds_allocator *allocator);
 DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, uint64_t size);
 DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr);
+DSHDEF double ds_allocator_fragmentation(ds_allocator *allocator);
+
+// ALLOCATOR STATS
+//
+// The allocator stats are an optional instrumentation layer around DS_MALLOC,
+// DS_REALLOC and DS_FREE. It is enabled by defining DS_AL_STATS. Every
+// allocation is tagged with the file and line of the call site, and the layer
+// keeps track of the live and peak bytes, the counters of each call site and
+// the number of allocations per tick. The stats can be exported as a JSON
+// report.
+#ifdef DS_AL_STATS
+#ifndef DS_AL_STATS_MAX_SITES
+#define DS_AL_STATS_MAX_SITES 256
+#endif
+
+typedef struct ds_allocator_stats_site {
+        const char *site;
+        const char *function;
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t bytes;
+        uint64_t live_bytes;
+} ds_allocator_stats_site;
+
+typedef struct ds_allocator_stats {
+        uint64_t live_bytes;
+        uint64_t peak_bytes;
+        uint64_t allocs;
+        uint64_t frees;
+        uint64_t bytes;
+        uint64_t ticks;
+        uint64_t tick_allocs;
+        uint64_t tick_bytes;
+        uint64_t max_tick_allocs;
+        uint64_t max_tick_bytes;
+} ds_allocator_stats;
+
+struct ds_string_builder;
+
+DSHDEF void *ds_allocator_stats_malloc(void *a, uint64_t size, const char *site,
+                                       const char *function);
+DSHDEF void *ds_allocator_stats_realloc(void *a, void *ptr, uint64_t old_size,
+                                        uint64_t new_size, const char *site,
+                                        const char *function);
+DSHDEF void ds_allocator_stats_free(void *a, void *ptr);
+DSHDEF void ds_allocator_stats_tick(void);
+DSHDEF void ds_allocator_stats_get(ds_allocator_stats *stats);
+DSHDEF int ds_allocator_stats_report(struct ds_string_builder *sb,
+                                     ds_allocator *allocator);
+#endif // DS_AL_STATS
 
 // DYNAMIC ARRAY
 //
@@ -113,6 +189,8 @@ DSHDEF int ds_dynamic_array_append(ds_dynamic_array *da, const void *item);
 DSHDEF int ds_dynamic_array_pop(ds_dynamic_array *da, const void **item);
 DSHDEF int ds_dynamic_array_append_many(ds_dynamic_array *da, void **new_items,
                                         unsigned int new_items_count);
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da,
+                                    unsigned int capacity);
 DSHDEF int ds_dynamic_array_get(ds_dynamic_array *da, unsigned int index,
                                 void *item);
 DSHDEF void ds_dynamic_array_get_ref(ds_dynamic_array *da, unsigned int index,
@@ -154,11 +232,19 @@ DSHDEF void ds_priority_queue_free(ds_priority_queue *pq);
 //
 // The string builder is a simple utility to build strings. You can append
 // formatted strings to the string builder, and then build the final string.
-// The string builder will automatically grow as needed.
+// The string builder will automatically grow as needed. Formatted strings are
+// written directly at the end of the builder, so once it has grown large
+// enough appending does not touch the heap. A builder can be cleared and
+// reused, for example once per rendered frame.
 typedef struct ds_string_builder {
         ds_dynamic_array items;
 } ds_string_builder;
 
+// Append a string literal (for example a pre-escaped ANSI sequence) without
+// having to compute its length at runtime
+#define ds_sb_append_literal(sb, str)                                          \
+    ds_string_builder_appendn(sb, "" str "", sizeof(str) - 1)
+
 DSHDEF void ds_string_builder_init_allocator(ds_string_builder *sb,
                                              struct ds_allocator *allocator);
 DSHDEF void ds_string_builder_init(ds_string_builder *sb);
@@ -167,6 +253,11 @@ DSHDEF int ds_string_builder_append(ds_string_builder *sb, const char *format,
 DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
                                      unsigned int len);
 DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr);
+DSHDEF int ds_string_builder_appendi(ds_string_builder *sb, int64_t value);
+DSHDEF int ds_string_builder_appendu(ds_string_builder *sb, uint64_t value);
+DSHDEF int ds_string_builder_reserve(ds_string_builder *sb,
+                                     unsigned int additional);
+DSHDEF void ds_string_builder_clear(ds_string_builder *sb);
 DSHDEF int ds_string_builder_build(ds_string_builder *sb, char **str);
 DSHDEF void ds_string_builder_free(ds_string_builder *sb);
 
@@ -175,6 +266,11 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb);
 // The string slice is a simple utility to work with substrings. You can use the
 // string slice to tokenize a string, and to convert a string slice to an owned
 // string.
+//
+// Searching for a character (tokenize, find and count) compares 16 bytes at a
+// time with SSE2 or 32 bytes at a time with AVX2 on x86. AVX2 is used when the
+// code is compiled for it or, with GCC and clang, when the CPU reports it at
+// run time. Other targets use a scalar loop.
 typedef struct ds_string_slice {
         struct ds_allocator *allocator;
         char *str;
@@ -188,6 +284,9 @@ DSHDEF void ds_string_slice_init(ds_string_slice *ss, char *str,
                                  unsigned int len);
 DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
                                     ds_string_slice *token);
+DSHDEF int ds_string_slice_find(ds_string_slice *ss, char chr,
+                                unsigned int *index);
+DSHDEF unsigned int ds_string_slice_count(ds_string_slice *ss, char chr);
 DSHDEF int ds_string_slice_trim_left(ds_string_slice *ss, char chr);
 DSHDEF int ds_string_slice_trim_right(ds_string_slice *ss, char chr);
 DSHDEF int ds_string_slice_trim(ds_string_slice *ss, char chr);
@@ -222,6 +321,84 @@ DSHDEF int ds_linked_list_pop_front(ds_linked_list *ll, void *item);
 DSHDEF int ds_linked_list_empty(ds_linked_list *ll);
 DSHDEF void ds_linked_list_free(ds_linked_list *ll);
 
+// UNROLLED LINKED LIST
+//
+// The unrolled linked list is a variant of the linked list that packs several
+// items in each node. The items of a node are stored contiguously, so walking
+// the list touches one node per DS_UL_NODE_SIZE bytes of items instead of two
+// allocations per item. Pushing and popping at both ends is O(1) amortized.
+#ifndef DS_UL_NODE_SIZE
+#define DS_UL_NODE_SIZE 512
+#endif
+
+typedef struct ds_unrolled_list_node {
+        struct ds_unrolled_list_node *prev;
+        struct ds_unrolled_list_node *next;
+        unsigned int begin;
+        unsigned int count;
+} ds_unrolled_list_node;
+
+typedef struct ds_unrolled_list {
+        struct ds_allocator *allocator;
+        unsigned int item_size;
+        unsigned int node_capacity;
+        unsigned int count;
+        ds_unrolled_list_node *head;
+        ds_unrolled_list_node *tail;
+        ds_unrolled_list_node *spare;
+} ds_unrolled_list;
+
+typedef struct ds_unrolled_list_iterator {
+        ds_unrolled_list *ul;
+        ds_unrolled_list_node *node;
+        unsigned int index;
+} ds_unrolled_list_iterator;
+
+DSHDEF void ds_unrolled_list_init_allocator(ds_unrolled_list *ul,
+                                            unsigned int item_size,
+                                            struct ds_allocator *allocator);
+DSHDEF void ds_unrolled_list_init(ds_unrolled_list *ul, unsigned int item_size);
+DSHDEF int ds_unrolled_list_push_back(ds_unrolled_list *ul, void *item);
+DSHDEF int ds_unrolled_list_push_front(ds_unrolled_list *ul, void *item);
+DSHDEF int ds_unrolled_list_pop_back(ds_unrolled_list *ul, void *item);
+DSHDEF int ds_unrolled_list_pop_front(ds_unrolled_list *ul, void *item);
+DSHDEF int ds_unrolled_list_empty(ds_unrolled_list *ul);
+DSHDEF void ds_unrolled_list_iterator_init(ds_unrolled_list *ul,
+                                           ds_unrolled_list_iterator *it);
+DSHDEF int ds_unrolled_list_iterator_next(ds_unrolled_list_iterator *it,
+                                          void **item);
+DSHDEF void ds_unrolled_list_free(ds_unrolled_list *ul);
+
+// INTRUSIVE LINKED LIST
+//
+// The intrusive linked list does not own its items. Instead, the user embeds a
+// ds_intrusive_list_node in their own struct and links that. The list never
+// allocates, and ds_container_of recovers the struct from a node.
+typedef struct ds_intrusive_list_node {
+        struct ds_intrusive_list_node *prev;
+        struct ds_intrusive_list_node *next;
+} ds_intrusive_list_node;
+
+typedef struct ds_intrusive_list {
+        ds_intrusive_list_node head;
+} ds_intrusive_list;
+
+#ifndef ds_container_of
+#define ds_container_of(ptr, type, member)                                     \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#endif // ds_container_of
+
+DSHDEF void ds_intrusive_list_init(ds_intrusive_list *il);
+DSHDEF void ds_intrusive_list_push_back(ds_intrusive_list *il,
+                                        ds_intrusive_list_node *node);
+DSHDEF void ds_intrusive_list_push_front(ds_intrusive_list *il,
+                                         ds_intrusive_list_node *node);
+DSHDEF ds_intrusive_list_node *ds_intrusive_list_pop_back(ds_intrusive_list *il);
+DSHDEF ds_intrusive_list_node *
+ds_intrusive_list_pop_front(ds_intrusive_list *il);
+DSHDEF void ds_intrusive_list_remove(ds_intrusive_list_node *node);
+DSHDEF int ds_intrusive_list_empty(ds_intrusive_list *il);
+
 // HASH TABLE
 //
 // The hash table is a simple table that uses a hash function to store and
@@ -323,12 +500,24 @@ DSHDEF void ds_argparse_parser_free(struct ds_argparse_parser *parser);
 // IO
 //
 // The io utils are a simple set of utilities to read and write files.
+//
+// ds_io_map_file maps a whole file into memory with mmap, or reads it with a
+// single buffer sized from fstat when the file cannot be mapped. The contents
+// can be used in place, without copying them line by line.
 #ifndef LINE_MAX
 #define LINE_MAX 4096
 #endif
 
+typedef struct ds_io_mapping {
+        char *data;
+        unsigned int length;
+        int mapped; // 1 if data is mmapped, 0 if it was read into a buffer
+} ds_io_mapping;
+
 DSHDEF int ds_io_read_file(const char *path, char **buffer);
 DSHDEF int ds_io_write_file(const char *path, const char *buffer, const char *mode);
+DSHDEF int ds_io_map_file(const char *path, ds_io_mapping *mapping);
+DSHDEF void ds_io_unmap_file(ds_io_mapping *mapping);
 
 // RETURN DEFER
 //
@@ -417,6 +606,38 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_REALLOC(a, ptr, old_sz, new_sz) ds_realloc(a, ptr, old_sz, new_sz)
 #endif
 
+// The stats layer keeps a reference to the allocation macros selected above
+// and then replaces them with versions that tag each call with its site.
+#ifdef DS_AL_STATS
+static inline void *ds_allocator_stats_raw_malloc(void *a, uint64_t sz) {
+    (void)a;
+    return DS_MALLOC(a, sz);
+}
+static inline void *ds_allocator_stats_raw_realloc(void *a, void *ptr,
+                                                   uint64_t old_sz,
+                                                   uint64_t new_sz) {
+    (void)a;
+    (void)old_sz;
+    return DS_REALLOC(a, ptr, old_sz, new_sz);
+}
+static inline void ds_allocator_stats_raw_free(void *a, void *ptr) {
+    (void)a;
+    DS_FREE(a, ptr);
+}
+
+#define DS_AL_STRINGIFY_(x) #x
+#define DS_AL_STRINGIFY(x) DS_AL_STRINGIFY_(x)
+#define DS_AL_SITE __FILE__ ":" DS_AL_STRINGIFY(__LINE__)
+
+#undef DS_MALLOC
+#undef DS_REALLOC
+#undef DS_FREE
+#define DS_MALLOC(a, sz) ds_allocator_stats_malloc(a, sz, DS_AL_SITE, __func__)
+#define DS_REALLOC(a, ptr, old_sz, new_sz)                                     \
+    ds_allocator_stats_realloc(a, ptr, old_sz, new_sz, DS_AL_SITE, __func__)
+#define DS_FREE(a, ptr) ds_allocator_stats_free(a, ptr)
+#endif // DS_AL_STATS
+
 #if defined(DS_EXIT)
 // ok
 #elif !defined(DS_EXIT) && !defined(DS_NO_STDLIB)
@@ -600,6 +821,11 @@ static inline void *ds_realloc(void *a, void *ptr, unsigned int old_sz,
 #define DS_DA_IMPLEMENTATION
 #endif // DS_AP_IMPLEMENTATION
 
+#if defined(DS_AL_IMPLEMENTATION) && defined(DS_AL_STATS)
+#define DS_SB_IMPLEMENTATION
+#define DS_DA_IMPLEMENTATION
+#endif // DS_AL_IMPLEMENTATION && DS_AL_STATS
+
 #ifdef DS_PQ_IMPLEMENTATION
 
 // Initialize the priority queue with a custom allocator
@@ -747,35 +973,44 @@ DSHDEF int ds_string_builder_appendn(ds_string_builder *sb, const char *str,
 
 // Append a formatted string to the string builder
 //
+// The string is formatted directly into the free space at the end of the
+// builder. Only if it does not fit, the builder grows and the string is
+// formatted a second time.
+//
 // Returns 0 if the string was appended successfully.
 DSHDEF int ds_string_builder_append(ds_string_builder *sb, const char *format,
                                     ...) {
     int result = 0;
 
+    unsigned int available = sb->items.capacity - sb->items.count;
+    char *end = (char *)sb->items.items + sb->items.count;
+
     va_list args;
     va_start(args, format);
-    int needed = vsnprintf(NULL, 0, format, args);
+    int needed = vsnprintf(available > 0 ? end : NULL, available, format, args);
     va_end(args);
 
-    char *buffer = DS_MALLOC(sb->items.allocator, needed + 1);
-    if (buffer == NULL) {
-        DS_LOG_ERROR("Failed to allocate string");
+    if (needed < 0) {
+        DS_LOG_ERROR("Failed to format string");
         return_defer(1);
     }
 
-    va_start(args, format);
-    vsnprintf(buffer, needed + 1, format, args);
-    va_end(args);
+    // vsnprintf needs room for the null terminator as well
+    if ((unsigned int)needed >= available) {
+        if (ds_string_builder_reserve(sb, needed + 1) != 0) {
+            return_defer(1);
+        }
 
-    if (ds_dynamic_array_append_many(&sb->items, (void **)buffer, needed) !=
-        0) {
-        return_defer(1);
+        end = (char *)sb->items.items + sb->items.count;
+
+        va_start(args, format);
+        vsnprintf(end, needed + 1, format, args);
+        va_end(args);
     }
 
+    sb->items.count += needed;
+
 defer:
-    if (buffer != NULL) {
-        DS_FREE(sb->items.allocator, buffer);
-    }
     return result;
 }
 
@@ -783,9 +1018,60 @@ defer:
 //
 // Returns 0 if the character was appended successfully.
 DSHDEF int ds_string_builder_appendc(ds_string_builder *sb, char chr) {
+    if (sb->items.count < sb->items.capacity) {
+        ((char *)sb->items.items)[sb->items.count++] = chr;
+        return 0;
+    }
+
     return ds_dynamic_array_append(&sb->items, &chr);
 }
 
+// Append an unsigned integer in base 10 to the string builder
+//
+// Returns 0 if the integer was appended successfully.
+DSHDEF int ds_string_builder_appendu(ds_string_builder *sb, uint64_t value) {
+    char buffer[20];
+    unsigned int len = 0;
+
+    do {
+        buffer[sizeof(buffer) - 1 - len++] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    return ds_string_builder_appendn(sb, buffer + sizeof(buffer) - len, len);
+}
+
+// Append a signed integer in base 10 to the string builder
+//
+// Returns 0 if the integer was appended successfully.
+DSHDEF int ds_string_builder_appendi(ds_string_builder *sb, int64_t value) {
+    if (value < 0) {
+        if (ds_string_builder_appendc(sb, '-') != 0) {
+            return 1;
+        }
+        return ds_string_builder_appendu(sb, -(uint64_t)value);
+    }
+
+    return ds_string_builder_appendu(sb, (uint64_t)value);
+}
+
+// Make sure that at least additional more characters fit in the builder
+//
+// Returns 0 if the space was reserved successfully, 1 if the builder could not
+// be reallocated.
+DSHDEF int ds_string_builder_reserve(ds_string_builder *sb,
+                                     unsigned int additional) {
+    return ds_dynamic_array_reserve(&sb->items, sb->items.count + additional);
+}
+
+// Clear the string builder
+//
+// The contents are dropped but the memory is kept, so the builder can be
+// filled again without allocating.
+DSHDEF void ds_string_builder_clear(ds_string_builder *sb) {
+    sb->items.count = 0;
+}
+
 // Build the final string from the string builder
 //
 // Returns 0 if the string was built successfully, 1 if the string could not be
@@ -815,6 +1101,168 @@ DSHDEF void ds_string_builder_free(ds_string_builder *sb) {
 
 #ifdef DS_SS_IMPLEMENTATION
 
+#if !defined(DS_SS_NO_SIMD) && defined(__SSE2__)
+#define DS_SS_SSE2
+#include <emmintrin.h>
+#if !defined(DS_SS_NO_AVX2) &&                                                 \
+    (defined(__AVX2__) || defined(__GNUC__) || defined(__clang__))
+#define DS_SS_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+static const char *string_slice_scan_scalar(const char *str, unsigned int len,
+                                            char chr) {
+    for (unsigned int i = 0; i < len; i++) {
+        if (str[i] == chr) {
+            return str + i;
+        }
+    }
+
+    return NULL;
+}
+
+static unsigned int string_slice_count_scalar(const char *str,
+                                              unsigned int len, char chr) {
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < len; i++) {
+        count += (str[i] == chr);
+    }
+
+    return count;
+}
+
+#ifdef DS_SS_SSE2
+static const char *string_slice_scan_sse2(const char *str, unsigned int len,
+                                          char chr) {
+    __m128i needle = _mm_set1_epi8(chr);
+    unsigned int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return str + i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i < len && len >= 16) {
+        // Finish with one load that overlaps the bytes already scanned
+        i = len - 16;
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        return (mask != 0) ? str + i + __builtin_ctz(mask) : NULL;
+    }
+
+    return string_slice_scan_scalar(str + i, len - i, chr);
+}
+
+// The matches are counted in 16 byte lanes (a match is -1, so subtracting it
+// adds one) and the lanes are summed before any of them can overflow
+static unsigned int string_slice_count_sse2(const char *str, unsigned int len,
+                                            char chr) {
+    __m128i needle = _mm_set1_epi8(chr);
+    __m128i zero = _mm_setzero_si128();
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    while (i + 16 <= len) {
+        __m128i lanes = _mm_setzero_si128();
+        for (unsigned int n = 0; n < 255 && i + 16 <= len; n++, i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+            lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(chunk, needle));
+        }
+
+        __m128i sums = _mm_sad_epu8(lanes, zero);
+        count += _mm_cvtsi128_si32(sums) +
+                 _mm_cvtsi128_si32(_mm_unpackhi_epi64(sums, sums));
+    }
+
+    return count + string_slice_count_scalar(str + i, len - i, chr);
+}
+#endif // DS_SS_SSE2
+
+#ifdef DS_SS_AVX2
+#ifndef __AVX2__
+__attribute__((target("avx2")))
+#endif
+static const char *string_slice_scan_avx2(const char *str, unsigned int len,
+                                          char chr) {
+    __m256i needle = _mm256_set1_epi8(chr);
+    unsigned int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        unsigned int mask =
+            (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return str + i + __builtin_ctz(mask);
+        }
+    }
+
+    if (i < len) {
+        i = len - 32;
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        unsigned int mask =
+            (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        return (mask != 0) ? str + i + __builtin_ctz(mask) : NULL;
+    }
+
+    return NULL;
+}
+
+#ifndef __AVX2__
+__attribute__((target("avx2")))
+#endif
+static unsigned int string_slice_count_avx2(const char *str, unsigned int len,
+                                            char chr) {
+    __m256i needle = _mm256_set1_epi8(chr);
+    __m256i zero = _mm256_setzero_si256();
+    unsigned int count = 0;
+    unsigned int i = 0;
+
+    while (i + 32 <= len) {
+        __m256i lanes = _mm256_setzero_si256();
+        for (unsigned int n = 0; n < 255 && i + 32 <= len; n++, i += 32) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+            lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(chunk, needle));
+        }
+
+        __m256i sums = _mm256_sad_epu8(lanes, zero);
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums),
+                                     _mm256_extracti128_si256(sums, 1));
+        count += _mm_cvtsi128_si32(half) +
+                 _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+    }
+
+    return count + string_slice_count_sse2(str + i, len - i, chr);
+}
+
+static int string_slice_has_avx2(void) {
+#ifdef __AVX2__
+    return 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif // DS_SS_AVX2
+
+// Find the first occurrence of a character using the widest scan available
+static const char *string_slice_scan(const char *str, unsigned int len,
+                                     char chr) {
+#if defined(DS_SS_AVX2)
+    if (len >= 32 && string_slice_has_avx2()) {
+        return string_slice_scan_avx2(str, len, chr);
+    }
+#endif
+#if defined(DS_SS_SSE2)
+    return string_slice_scan_sse2(str, len, chr);
+#else
+    return string_slice_scan_scalar(str, len, chr);
+#endif
+}
+
 DSHDEF void ds_string_slice_init_allocator(ds_string_slice *ss, char *str,
                                            unsigned int len,
                                            struct ds_allocator *allocator) {
@@ -843,13 +1291,13 @@ DSHDEF int ds_string_slice_tokenize(ds_string_slice *ss, char delimiter,
     token->str = ss->str;
     token->len = 0;
 
-    for (unsigned int i = 0; i < ss->len; i++) {
-        if (ss->str[i] == delimiter) {
-            token->len = i;
-            ss->str += i + 1;
-            ss->len -= i + 1;
-            return_defer(0);
-        }
+    const char *found = string_slice_scan(ss->str, ss->len, delimiter);
+    if (found != NULL) {
+        unsigned int i = (unsigned int)(found - ss->str);
+        token->len = i;
+        ss->str += i + 1;
+        ss->len -= i + 1;
+        return_defer(0);
     }
 
     token->len = ss->len;
@@ -860,6 +1308,50 @@ defer:
     return result;
 }
 
+// Find the first occurrence of a character in the string slice
+//
+// Returns 0 if the character was found and sets index to its position, 1 if
+// the character is not in the string slice.
+DSHDEF int ds_string_slice_find(ds_string_slice *ss, char chr,
+                                unsigned int *index) {
+    int result = 0;
+
+    if (ss->len == 0 || ss->str == NULL) {
+        return_defer(1);
+    }
+
+    const char *found = string_slice_scan(ss->str, ss->len, chr);
+    if (found == NULL) {
+        return_defer(1);
+    }
+
+    *index = (unsigned int)(found - ss->str);
+
+defer:
+    return result;
+}
+
+// Count the occurrences of a character in the string slice, for example to
+// presize an array before tokenizing
+//
+// Returns the number of occurrences.
+DSHDEF unsigned int ds_string_slice_count(ds_string_slice *ss, char chr) {
+    if (ss->len == 0 || ss->str == NULL) {
+        return 0;
+    }
+
+#if defined(DS_SS_AVX2)
+    if (ss->len >= 32 && string_slice_has_avx2()) {
+        return string_slice_count_avx2(ss->str, ss->len, chr);
+    }
+#endif
+#if defined(DS_SS_SSE2)
+    return string_slice_count_sse2(ss->str, ss->len, chr);
+#else
+    return string_slice_count_scalar(ss->str, ss->len, chr);
+#endif
+}
+
 // Trim the left side of the string slice by a character
 //
 // Returns 0 if the string was trimmed successfully, 1 if the string slice is
@@ -1044,6 +1536,40 @@ defer:
     return result;
 }
 
+// Grow the dynamic array so it can hold at least capacity items
+//
+// Returns 0 if the array has enough room, 1 if the array could not be
+// reallocated.
+DSHDEF int ds_dynamic_array_reserve(ds_dynamic_array *da,
+                                    unsigned int capacity) {
+    int result = 0;
+
+    if (capacity <= da->capacity) {
+        return_defer(0);
+    }
+
+    unsigned int new_capacity = da->capacity;
+    if (new_capacity == 0) {
+        new_capacity = DS_DA_INIT_CAPACITY;
+    }
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    da->items = DS_REALLOC(da->allocator, da->items,
+                           da->capacity * da->item_size,
+                           new_capacity * da->item_size);
+    if (da->items == NULL) {
+        DS_LOG_ERROR("Failed to reallocate dynamic array");
+        return_defer(1);
+    }
+
+    da->capacity = new_capacity;
+
+defer:
+    return result;
+}
+
 // Get an item from the dynamic array
 //
 // Returns 0 if the item was retrieved successfully, 1 if the index is out of
@@ -1367,90 +1893,416 @@ DSHDEF void ds_linked_list_free(ds_linked_list *ll) {
     ll->tail = NULL;
 }
 
-#endif // DS_ST_IMPLEMENTATION
-
-#ifdef DS_HT_IMPLEMENTATION
+#define UNROLLED_LIST_NODE_HEADER_SIZE                                         \
+    ((sizeof(ds_unrolled_list_node) + 15) & ~(unsigned int)15)
 
-// Initialize the hash table with a custom allocator
-DSHDEF int
-ds_hash_table_init_allocator(ds_hash_table *ht, unsigned int key_size,
-                             unsigned int value_size, unsigned int capacity,
-                             unsigned int (*hash)(const void *),
-                             int (*compare)(const void *, const void *),
-                             struct ds_allocator *allocator) {
-    int result = 0;
+static inline void *unrolled_list_node_item(ds_unrolled_list *ul,
+                                            ds_unrolled_list_node *node,
+                                            unsigned int index) {
+    return (char *)node + UNROLLED_LIST_NODE_HEADER_SIZE +
+           (node->begin + index) * ul->item_size;
+}
 
-    ht->allocator = allocator;
+// Get an empty node, reusing the last released one if there is any
+static ds_unrolled_list_node *unrolled_list_node_new(ds_unrolled_list *ul) {
+    ds_unrolled_list_node *node = ul->spare;
 
-    ht->keys = DS_MALLOC(ht->allocator, capacity * sizeof(ds_dynamic_array));
-    if (ht->keys == NULL) {
-        DS_LOG_ERROR("Failed to allocate hash table keys");
-        return_defer(1);
+    if (node != NULL) {
+        ul->spare = NULL;
+    } else {
+        node = DS_MALLOC(ul->allocator, UNROLLED_LIST_NODE_HEADER_SIZE +
+                                            ul->node_capacity * ul->item_size);
+        if (node == NULL) {
+            DS_LOG_ERROR("Failed to allocate unrolled list node");
+            return NULL;
+        }
     }
 
-    ht->values = DS_MALLOC(ht->allocator, capacity * sizeof(ds_dynamic_array));
-    if (ht->values == NULL) {
-        DS_LOG_ERROR("Failed to allocate hash table values");
-        return_defer(1);
-    }
+    node->prev = NULL;
+    node->next = NULL;
+    node->begin = 0;
+    node->count = 0;
 
-    for (unsigned int i = 0; i < capacity; i++) {
-        ds_dynamic_array_init(ht->keys + i, key_size);
-        ds_dynamic_array_init(ht->values + i, value_size);
+    return node;
+}
+
+// Unlink an empty node and keep it around for the next push
+static void unrolled_list_node_release(ds_unrolled_list *ul,
+                                       ds_unrolled_list_node *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        ul->head = node->next;
     }
 
-    ht->key_size = key_size;
-    ht->value_size = value_size;
-    ht->capacity = capacity;
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        ul->tail = node->prev;
+    }
 
-    ht->hash = hash;
-    ht->compare = compare;
+    if (ul->spare != NULL) {
+        DS_FREE(ul->allocator, ul->spare);
+    }
+    ul->spare = node;
+}
 
-defer:
-    if (result != 0) {
-        if (ht->keys != NULL) {
-            DS_FREE(NULL, ht->keys);
-        }
-        if (ht->values != NULL) {
-            DS_FREE(NULL, ht->values);
-        }
+// Initialize the unrolled linked list with a custom allocator
+//
+// The item_size parameter is the size of each item in the list.
+DSHDEF void ds_unrolled_list_init_allocator(ds_unrolled_list *ul,
+                                            unsigned int item_size,
+                                            struct ds_allocator *allocator) {
+    ul->allocator = allocator;
+    ul->item_size = item_size;
+    ul->node_capacity = 1;
+    if (item_size > 0 &&
+        DS_UL_NODE_SIZE > UNROLLED_LIST_NODE_HEADER_SIZE + item_size) {
+        ul->node_capacity =
+            (DS_UL_NODE_SIZE - UNROLLED_LIST_NODE_HEADER_SIZE) / item_size;
     }
-    return result;
+    ul->count = 0;
+    ul->head = NULL;
+    ul->tail = NULL;
+    ul->spare = NULL;
 }
 
-// Initialize the hash table
+// Initialize the unrolled linked list
 //
-// The key_size and value_size parameters are the size of each key and value in
-// the table. The capacity parameter is the initial capacity of the table. The
-// hash and compare parameters are the hash and compare functions to use when
-// inserting and retrieving items.
-DSHDEF int ds_hash_table_init(ds_hash_table *ht, unsigned int key_size,
-                              unsigned int value_size, unsigned int capacity,
-                              unsigned int (*hash)(const void *),
-                              int (*compare)(const void *, const void *)) {
-    return ds_hash_table_init_allocator(ht, key_size, value_size, capacity,
-                                        hash, compare, NULL);
+// The item_size parameter is the size of each item in the list.
+DSHDEF void ds_unrolled_list_init(ds_unrolled_list *ul,
+                                  unsigned int item_size) {
+    ds_unrolled_list_init_allocator(ul, item_size, NULL);
 }
 
-// Insert an item into the hash table
+// Push an item to the back of the unrolled linked list
 //
-// Returns 0 if the item was inserted successfully, 1 if the item could not be
-// inserted.
-DSHDEF int ds_hash_table_insert(ds_hash_table *ht, const void *key,
-                                void *value) {
+// Returns 0 if the item was pushed successfully, 1 if the list could not be
+// allocated.
+DSHDEF int ds_unrolled_list_push_back(ds_unrolled_list *ul, void *item) {
     int result = 0;
 
-    unsigned int index = ht->hash(key) % ht->capacity;
+    ds_unrolled_list_node *node = ul->tail;
+    if (node == NULL || node->begin + node->count == ul->node_capacity) {
+        node = unrolled_list_node_new(ul);
+        if (node == NULL) {
+            return_defer(1);
+        }
 
-    ds_dynamic_array *keys = ht->keys + index;
-    ds_dynamic_array *values = ht->values + index;
+        node->prev = ul->tail;
+        if (ul->tail != NULL) {
+            ul->tail->next = node;
+        } else {
+            ul->head = node;
+        }
+        ul->tail = node;
+    }
 
-    for (unsigned int i = 0; i < keys->count; i++) {
-        void *k = NULL;
-        ds_dynamic_array_get_ref(keys, i, &k);
+    DS_MEMCPY(unrolled_list_node_item(ul, node, node->count), item,
+              ul->item_size);
+    node->count++;
+    ul->count++;
 
-        if (ht->compare(k, key) == 0) {
-            void *v = NULL;
+defer:
+    return result;
+}
+
+// Push an item to the front of the unrolled linked list
+//
+// Returns 0 if the item was pushed successfully, 1 if the list could not be
+// allocated.
+DSHDEF int ds_unrolled_list_push_front(ds_unrolled_list *ul, void *item) {
+    int result = 0;
+
+    ds_unrolled_list_node *node = ul->head;
+    if (node == NULL || node->begin == 0) {
+        node = unrolled_list_node_new(ul);
+        if (node == NULL) {
+            return_defer(1);
+        }
+
+        // New front nodes fill up from their end
+        node->begin = ul->node_capacity;
+        node->next = ul->head;
+        if (ul->head != NULL) {
+            ul->head->prev = node;
+        } else {
+            ul->tail = node;
+        }
+        ul->head = node;
+    }
+
+    node->begin--;
+    node->count++;
+    DS_MEMCPY(unrolled_list_node_item(ul, node, 0), item, ul->item_size);
+    ul->count++;
+
+defer:
+    return result;
+}
+
+// Pop an item from the back of the unrolled linked list
+//
+// Returns 0 if the item was popped successfully, 1 if the list is empty.
+// The item is stored in the item parameter.
+DSHDEF int ds_unrolled_list_pop_back(ds_unrolled_list *ul, void *item) {
+    int result = 0;
+
+    ds_unrolled_list_node *node = ul->tail;
+    if (node == NULL) {
+        DS_LOG_ERROR("Unrolled list is empty");
+        return_defer(1);
+    }
+
+    node->count--;
+    DS_MEMCPY(item, unrolled_list_node_item(ul, node, node->count),
+              ul->item_size);
+    ul->count--;
+
+    if (node->count == 0) {
+        unrolled_list_node_release(ul, node);
+    }
+
+defer:
+    return result;
+}
+
+// Pop an item from the front of the unrolled linked list
+//
+// Returns 0 if the item was popped successfully, 1 if the list is empty.
+// The item is stored in the item parameter.
+DSHDEF int ds_unrolled_list_pop_front(ds_unrolled_list *ul, void *item) {
+    int result = 0;
+
+    ds_unrolled_list_node *node = ul->head;
+    if (node == NULL) {
+        DS_LOG_ERROR("Unrolled list is empty");
+        return_defer(1);
+    }
+
+    DS_MEMCPY(item, unrolled_list_node_item(ul, node, 0), ul->item_size);
+    node->begin++;
+    node->count--;
+    ul->count--;
+
+    if (node->count == 0) {
+        unrolled_list_node_release(ul, node);
+    }
+
+defer:
+    return result;
+}
+
+// Check if the unrolled linked list is empty
+//
+// Returns 1 if the list is empty, 0 if the list is not empty.
+DSHDEF int ds_unrolled_list_empty(ds_unrolled_list *ul) {
+    return ul->head == NULL;
+}
+
+// Initialize an iterator over the unrolled linked list, from front to back
+DSHDEF void ds_unrolled_list_iterator_init(ds_unrolled_list *ul,
+                                           ds_unrolled_list_iterator *it) {
+    it->ul = ul;
+    it->node = ul->head;
+    it->index = 0;
+}
+
+// Get a reference to the next item of the iterator
+//
+// Returns 0 if an item was found, 1 if the iterator reached the end.
+DSHDEF int ds_unrolled_list_iterator_next(ds_unrolled_list_iterator *it,
+                                          void **item) {
+    while (it->node != NULL && it->index >= it->node->count) {
+        it->node = it->node->next;
+        it->index = 0;
+    }
+
+    if (it->node == NULL) {
+        return 1;
+    }
+
+    *item = unrolled_list_node_item(it->ul, it->node, it->index);
+    it->index++;
+
+    return 0;
+}
+
+// Free the unrolled linked list
+DSHDEF void ds_unrolled_list_free(ds_unrolled_list *ul) {
+    ds_unrolled_list_node *node = ul->head;
+    while (node != NULL) {
+        ds_unrolled_list_node *next = node->next;
+        DS_FREE(ul->allocator, node);
+        node = next;
+    }
+
+    if (ul->spare != NULL) {
+        DS_FREE(ul->allocator, ul->spare);
+    }
+
+    ul->count = 0;
+    ul->head = NULL;
+    ul->tail = NULL;
+    ul->spare = NULL;
+}
+
+// Initialize the intrusive linked list
+DSHDEF void ds_intrusive_list_init(ds_intrusive_list *il) {
+    il->head.prev = &il->head;
+    il->head.next = &il->head;
+}
+
+static inline void intrusive_list_insert(ds_intrusive_list_node *node,
+                                         ds_intrusive_list_node *prev,
+                                         ds_intrusive_list_node *next) {
+    node->prev = prev;
+    node->next = next;
+    prev->next = node;
+    next->prev = node;
+}
+
+// Link a node at the back of the intrusive linked list
+DSHDEF void ds_intrusive_list_push_back(ds_intrusive_list *il,
+                                        ds_intrusive_list_node *node) {
+    intrusive_list_insert(node, il->head.prev, &il->head);
+}
+
+// Link a node at the front of the intrusive linked list
+DSHDEF void ds_intrusive_list_push_front(ds_intrusive_list *il,
+                                         ds_intrusive_list_node *node) {
+    intrusive_list_insert(node, &il->head, il->head.next);
+}
+
+// Unlink a node from the intrusive linked list it belongs to
+DSHDEF void ds_intrusive_list_remove(ds_intrusive_list_node *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+// Unlink the node at the back of the intrusive linked list
+//
+// Returns the node, or NULL if the list is empty.
+DSHDEF ds_intrusive_list_node *
+ds_intrusive_list_pop_back(ds_intrusive_list *il) {
+    if (ds_intrusive_list_empty(il)) {
+        return NULL;
+    }
+
+    ds_intrusive_list_node *node = il->head.prev;
+    ds_intrusive_list_remove(node);
+
+    return node;
+}
+
+// Unlink the node at the front of the intrusive linked list
+//
+// Returns the node, or NULL if the list is empty.
+DSHDEF ds_intrusive_list_node *
+ds_intrusive_list_pop_front(ds_intrusive_list *il) {
+    if (ds_intrusive_list_empty(il)) {
+        return NULL;
+    }
+
+    ds_intrusive_list_node *node = il->head.next;
+    ds_intrusive_list_remove(node);
+
+    return node;
+}
+
+// Check if the intrusive linked list is empty
+//
+// Returns 1 if the list is empty, 0 if the list is not empty.
+DSHDEF int ds_intrusive_list_empty(ds_intrusive_list *il) {
+    return il->head.next == &il->head;
+}
+
+#endif // DS_ST_IMPLEMENTATION
+
+#ifdef DS_HT_IMPLEMENTATION
+
+// Initialize the hash table with a custom allocator
+DSHDEF int
+ds_hash_table_init_allocator(ds_hash_table *ht, unsigned int key_size,
+                             unsigned int value_size, unsigned int capacity,
+                             unsigned int (*hash)(const void *),
+                             int (*compare)(const void *, const void *),
+                             struct ds_allocator *allocator) {
+    int result = 0;
+
+    ht->allocator = allocator;
+
+    ht->keys = DS_MALLOC(ht->allocator, capacity * sizeof(ds_dynamic_array));
+    if (ht->keys == NULL) {
+        DS_LOG_ERROR("Failed to allocate hash table keys");
+        return_defer(1);
+    }
+
+    ht->values = DS_MALLOC(ht->allocator, capacity * sizeof(ds_dynamic_array));
+    if (ht->values == NULL) {
+        DS_LOG_ERROR("Failed to allocate hash table values");
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < capacity; i++) {
+        ds_dynamic_array_init(ht->keys + i, key_size);
+        ds_dynamic_array_init(ht->values + i, value_size);
+    }
+
+    ht->key_size = key_size;
+    ht->value_size = value_size;
+    ht->capacity = capacity;
+
+    ht->hash = hash;
+    ht->compare = compare;
+
+defer:
+    if (result != 0) {
+        if (ht->keys != NULL) {
+            DS_FREE(NULL, ht->keys);
+        }
+        if (ht->values != NULL) {
+            DS_FREE(NULL, ht->values);
+        }
+    }
+    return result;
+}
+
+// Initialize the hash table
+//
+// The key_size and value_size parameters are the size of each key and value in
+// the table. The capacity parameter is the initial capacity of the table. The
+// hash and compare parameters are the hash and compare functions to use when
+// inserting and retrieving items.
+DSHDEF int ds_hash_table_init(ds_hash_table *ht, unsigned int key_size,
+                              unsigned int value_size, unsigned int capacity,
+                              unsigned int (*hash)(const void *),
+                              int (*compare)(const void *, const void *)) {
+    return ds_hash_table_init_allocator(ht, key_size, value_size, capacity,
+                                        hash, compare, NULL);
+}
+
+// Insert an item into the hash table
+//
+// Returns 0 if the item was inserted successfully, 1 if the item could not be
+// inserted.
+DSHDEF int ds_hash_table_insert(ds_hash_table *ht, const void *key,
+                                void *value) {
+    int result = 0;
+
+    unsigned int index = ht->hash(key) % ht->capacity;
+
+    ds_dynamic_array *keys = ht->keys + index;
+    ds_dynamic_array *values = ht->values + index;
+
+    for (unsigned int i = 0; i < keys->count; i++) {
+        void *k = NULL;
+        ds_dynamic_array_get_ref(keys, i, &k);
+
+        if (ht->compare(k, key) == 0) {
+            void *v = NULL;
             ds_dynamic_array_get_ref(values, i, &v);
 
             DS_MEMCPY(v, value, ht->value_size);
@@ -1499,349 +2351,978 @@ DSHDEF int ds_hash_table_has(ds_hash_table *ht, const void *key) {
 DSHDEF int ds_hash_table_get(ds_hash_table *ht, const void *key, void *value) {
     int result = 0;
 
-    unsigned int index = ht->hash(key) % ht->capacity;
+    unsigned int index = ht->hash(key) % ht->capacity;
+
+    ds_dynamic_array *keys = ht->keys + index;
+    ds_dynamic_array *values = ht->values + index;
+
+    for (unsigned int i = 0; i < keys->count; i++) {
+        void *k = NULL;
+        ds_dynamic_array_get_ref(keys, i, &k);
+
+        if (ht->compare(k, key) == 0) {
+            ds_dynamic_array_get(values, i, value);
+            return_defer(0);
+        }
+    }
+
+    return_defer(1);
+
+defer:
+    return result;
+}
+
+// Get a reference to an item from the hash table
+//
+// Returns 0 if the item was retrieved successfully, 1 if the item was not
+// found.
+DSHDEF int ds_hash_table_get_ref(ds_hash_table *ht, const void *key,
+                                 void **value) {
+    int result = 0;
+
+    unsigned int index = ht->hash(key) % ht->capacity;
+
+    ds_dynamic_array *keys = ht->keys + index;
+    ds_dynamic_array *values = ht->values + index;
+
+    for (unsigned int i = 0; i < keys->count; i++) {
+        void *k = NULL;
+        ds_dynamic_array_get_ref(keys, i, &k);
+
+        if (ht->compare(k, key) == 0) {
+            ds_dynamic_array_get_ref(values, i, value);
+            return_defer(0);
+        }
+    }
+
+    return_defer(1);
+
+defer:
+    return result;
+}
+
+// Get the number of items in the hash table
+//
+// Returns the number of items in the hash table.
+DSHDEF unsigned int ds_hash_table_count(ds_hash_table *ht) {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < ht->capacity; i++) {
+        count += (ht->keys + i)->count;
+    }
+    return count;
+}
+
+// Remove an item from the hash table
+//
+// Returns 0 if the item was removed successfully, 1 if the item was not found.
+DSHDEF int ds_hash_table_remove(ds_hash_table *ht, const void *key) {
+    (void)ht;
+    (void)key;
+    DS_LOG_ERROR("Not implemented");
+    return 1;
+}
+
+// Free the hash table
+//
+// This function frees all the memory used by the hash table.
+DSHDEF void ds_hash_table_free(ds_hash_table *ht) {
+    for (unsigned int i = 0; i < ht->capacity; i++) {
+        ds_dynamic_array_free(ht->keys + i);
+        ds_dynamic_array_free(ht->values + i);
+    }
+    DS_FREE(NULL, ht->keys);
+    DS_FREE(NULL, ht->values);
+}
+
+#endif // DS_HT_IMPLEMENTATION
+
+#ifdef DS_AL_IMPLEMENTATION
+
+#define BLOCK_METADATA_SIZE 16
+#define BLOCK_ALIGNMENT 16
+#define BLOCK_INDEX_UNDEFINED -1
+#define BLOCK_FREE_BIT 1
+
+/*
+ * | prev | size | ... size bytes of data ... |
+ *
+ * The blocks are laid out back to back, so the next block always starts right
+ * after the data of the current one and only the offset of the previous block
+ * needs to be stored. Sizes are multiples of BLOCK_ALIGNMENT, which leaves the
+ * lowest bit of the size free to mark the block as free.
+ *
+ * Both fields are stored little endian. On little endian hosts the header is
+ * accessed as a native struct, elsewhere it is encoded one byte at a time.
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ &&   \
+    !defined(DS_AL_PORTABLE_HEADER)
+#define DS_AL_NATIVE_HEADER
+#endif
+
+#ifdef DS_AL_NATIVE_HEADER
+
+typedef struct block_header {
+        int64_t prev;  // 8 bytes
+        uint64_t size; // 8 bytes
+} block_header;
+
+static inline int64_t block_get_prev(uint8_t *ptr) {
+    return ((block_header *)ptr)->prev;
+}
+
+static inline uint64_t block_get_size(uint8_t *ptr) {
+    return ((block_header *)ptr)->size;
+}
+
+static inline void block_set(uint8_t *ptr, int64_t prev, uint64_t size) {
+    ((block_header *)ptr)->prev = prev;
+    ((block_header *)ptr)->size = size;
+}
+
+static inline void block_set_prev(uint8_t *ptr, int64_t prev) {
+    ((block_header *)ptr)->prev = prev;
+}
+
+#else
+
+static void uint64_read_le(uint8_t *data, uint64_t *value) {
+    *value = ((uint64_t)data[0] << 0) | ((uint64_t)data[1] << 8) |
+             ((uint64_t)data[2] << 16) | ((uint64_t)data[3] << 24) |
+             ((uint64_t)data[4] << 32) | ((uint64_t)data[5] << 40) |
+             ((uint64_t)data[6] << 48) | ((uint64_t)data[7] << 56);
+}
+
+static void uint64_write_le(uint8_t *data, uint64_t value) {
+    data[0] = (value >> 0) & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+    data[4] = (value >> 32) & 0xff;
+    data[5] = (value >> 40) & 0xff;
+    data[6] = (value >> 48) & 0xff;
+    data[7] = (value >> 56) & 0xff;
+}
+
+static inline int64_t block_get_prev(uint8_t *ptr) {
+    uint64_t value = 0;
+    uint64_read_le(ptr + 0, &value);
+    return (int64_t)value;
+}
+
+static inline uint64_t block_get_size(uint8_t *ptr) {
+    uint64_t value = 0;
+    uint64_read_le(ptr + 8, &value);
+    return value;
+}
+
+static inline void block_set(uint8_t *ptr, int64_t prev, uint64_t size) {
+    uint64_write_le(ptr + 0, (uint64_t)prev);
+    uint64_write_le(ptr + 8, size);
+}
+
+static inline void block_set_prev(uint8_t *ptr, int64_t prev) {
+    uint64_write_le(ptr + 0, (uint64_t)prev);
+}
+
+#endif // DS_AL_NATIVE_HEADER
+
+static inline uint64_t block_size(uint8_t *ptr) {
+    return block_get_size(ptr) & ~(uint64_t)BLOCK_FREE_BIT;
+}
+
+static inline int block_free(uint8_t *ptr) {
+    return (block_get_size(ptr) & BLOCK_FREE_BIT) != 0;
+}
+
+static inline uint8_t *block_next(uint8_t *ptr) {
+    return ptr + BLOCK_METADATA_SIZE + block_size(ptr);
+}
+
+static inline uint64_t block_align(uint64_t size) {
+    return (size + BLOCK_ALIGNMENT - 1) & ~(uint64_t)(BLOCK_ALIGNMENT - 1);
+}
+
+// Point the block that follows ptr back at it, or make ptr the last block
+static void allocator_link_next(ds_allocator *allocator, uint8_t *ptr) {
+    uint8_t *next = block_next(ptr);
+    if (next < allocator->top) {
+        block_set_prev(next, (int64_t)(ptr - allocator->start));
+    } else {
+        allocator->prev = ptr;
+    }
+}
+
+// Initialize the allocator
+//
+// The start parameter is the start of the memory block to allocate from, and
+// the size parameter is the maximum size of the memory allocator. The start is
+// rounded up to BLOCK_ALIGNMENT so that every block header is aligned.
+DSHDEF void ds_allocator_init(ds_allocator *allocator, uint8_t *start,
+                              uint64_t size) {
+    uint64_t padding = block_align((uintptr_t)start) - (uintptr_t)start;
+    if (padding > size) {
+        padding = size;
+    }
+
+    allocator->start = start + padding;
+    allocator->prev = NULL;
+    allocator->top = allocator->start;
+    allocator->size = (size - padding) & ~(uint64_t)(BLOCK_ALIGNMENT - 1);
+    allocator->shared = NULL;
+}
+
+// Dump the allocator to stdout
+//
+// This function prints the contents of the allocator to stdout.
+DSHDEF void ds_allocator_dump(ds_allocator *allocator) {
+    uint8_t *ptr = allocator->start;
+
+    fprintf(stdout, "%*s %*s %*s %*s %*s\n", 14, "", 14, "prev", 14, "next", 14,
+            "size", 14, "free");
+
+    while (ptr < allocator->top) {
+        int64_t prev_index = block_get_prev(ptr);
+        uint8_t *prev = (prev_index == BLOCK_INDEX_UNDEFINED)
+                            ? NULL
+                            : allocator->start + prev_index;
+        uint8_t *next = block_next(ptr);
+        if (next >= allocator->top) {
+            next = NULL;
+        }
+
+        fprintf(stdout, "%*p %*p %*p %*lu %*u\n", 14, ptr, 14, prev, 14, next,
+                14, block_size(ptr), 14, block_free(ptr));
+
+        ptr = block_next(ptr);
+    }
+}
+
+static void *allocator_find_block(ds_allocator *allocator, uint64_t size) {
+    if (allocator->prev == NULL) {
+        return NULL;
+    }
+
+    uint8_t *ptr = allocator->start;
+
+    while (ptr < allocator->top) {
+        uint64_t current_size = block_size(ptr);
+
+        if (block_free(ptr) &&
+            current_size >= size + BLOCK_METADATA_SIZE + BLOCK_ALIGNMENT) {
+            uint8_t *split = ptr + BLOCK_METADATA_SIZE + size;
+            uint64_t split_size = current_size - size - BLOCK_METADATA_SIZE;
+
+            block_set(ptr, block_get_prev(ptr), size);
+            block_set(split, (int64_t)(ptr - allocator->start),
+                      split_size | BLOCK_FREE_BIT);
+            allocator_link_next(allocator, split);
+
+            return ptr + BLOCK_METADATA_SIZE;
+        }
+
+        if (block_free(ptr) && current_size >= size) {
+            block_set(ptr, block_get_prev(ptr), current_size);
+
+            return ptr + BLOCK_METADATA_SIZE;
+        }
+
+        ptr += current_size + BLOCK_METADATA_SIZE;
+    }
+
+    return NULL;
+}
+
+static void *allocator_arena_alloc(ds_allocator *allocator, uint64_t size) {
+    size = block_align(size);
+
+    void *data = allocator_find_block(allocator, size);
+    if (data != NULL) {
+        return data;
+    }
+
+    if (allocator->top + size + BLOCK_METADATA_SIZE >
+        allocator->start + allocator->size) {
+        return NULL;
+    }
+
+    int64_t prev = (allocator->prev == NULL)
+                       ? BLOCK_INDEX_UNDEFINED
+                       : (int64_t)(allocator->prev - allocator->start);
+    block_set(allocator->top, prev, size);
+
+    allocator->prev = allocator->top;
+    allocator->top += size + BLOCK_METADATA_SIZE;
+
+    return allocator->prev + BLOCK_METADATA_SIZE;
+}
+
+static void allocator_arena_free(ds_allocator *allocator, void *ptr) {
+    if ((uint8_t *)ptr > allocator->top || (uint8_t *)ptr < allocator->start) {
+        return;
+    }
+
+    uint8_t *block = (uint8_t *)ptr - BLOCK_METADATA_SIZE;
+    int64_t prev = block_get_prev(block);
+    uint64_t size = block_size(block);
+
+    uint8_t *next = block_next(block);
+    if (next < allocator->top && block_free(next)) {
+        size += block_size(next) + BLOCK_METADATA_SIZE;
+    }
+
+    if (prev != BLOCK_INDEX_UNDEFINED && block_free(allocator->start + prev)) {
+        block = allocator->start + prev;
+        size += block_size(block) + BLOCK_METADATA_SIZE;
+        prev = block_get_prev(block);
+    }
+
+    block_set(block, prev, size | BLOCK_FREE_BIT);
+    allocator_link_next(allocator, block);
+}
+
+#define ALLOCATOR_SIZE_CLASSES 8
+#define ALLOCATOR_MIN_CLASS_SHIFT 4
+#define ALLOCATOR_CACHE_BATCH 16384
+#define ALLOCATOR_CLASS_LARGE 0xffffffff
+
+typedef struct ds_allocator_shared {
+        uint64_t id;
+        uint8_t lock;
+} ds_allocator_shared;
+
+typedef struct allocator_cache {
+        void *free[ALLOCATOR_SIZE_CLASSES];
+        void *remote;
+} allocator_cache;
+
+/*
+ * | owner | size_class | ... data ... |
+ *
+ * Every block handed out by a concurrent allocator starts with this header.
+ * The owner is the thread cache the block returns to when freed, or NULL for
+ * large blocks that go straight back to the shared memory block.
+ */
+typedef struct allocator_cache_header {
+        allocator_cache *owner; // 8 bytes
+        uint32_t size_class;    // 4 bytes
+        uint32_t reserved;      // 4 bytes
+} allocator_cache_header;
+
+#define ALLOCATOR_CACHE_HEADER_SIZE sizeof(allocator_cache_header)
+
+typedef struct allocator_cache_slot {
+        ds_allocator_shared *shared;
+        uint64_t id;
+        allocator_cache *cache;
+} allocator_cache_slot;
+
+static uint64_t allocator_shared_next_id = 0;
+static _Thread_local allocator_cache_slot
+    allocator_cache_slots[DS_AL_MAX_THREAD_CACHES];
+
+static void allocator_lock(ds_allocator_shared *shared) {
+    while (__atomic_test_and_set(&shared->lock, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+static void allocator_unlock(ds_allocator_shared *shared) {
+    __atomic_clear(&shared->lock, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int allocator_size_class(uint64_t size) {
+    if (size <= (1 << ALLOCATOR_MIN_CLASS_SHIFT)) {
+        return 0;
+    }
+    return 64 - __builtin_clzll(size - 1) - ALLOCATOR_MIN_CLASS_SHIFT;
+}
+
+static inline uint64_t allocator_class_size(unsigned int size_class) {
+    return (uint64_t)1 << (size_class + ALLOCATOR_MIN_CLASS_SHIFT);
+}
+
+static inline allocator_cache_header *allocator_cache_header_of(void *ptr) {
+    return (allocator_cache_header *)((uint8_t *)ptr -
+                                      ALLOCATOR_CACHE_HEADER_SIZE);
+}
+
+static inline void *allocator_cache_next(void *ptr) { return *(void **)ptr; }
+
+static inline void allocator_cache_set_next(void *ptr, void *next) {
+    *(void **)ptr = next;
+}
+
+static void *allocator_shared_alloc(ds_allocator *allocator, uint64_t size) {
+    allocator_lock(allocator->shared);
+    void *ptr = allocator_arena_alloc(allocator, size);
+    allocator_unlock(allocator->shared);
+
+    return ptr;
+}
+
+static void allocator_shared_free(ds_allocator *allocator, void *ptr) {
+    allocator_lock(allocator->shared);
+    allocator_arena_free(allocator, ptr);
+    allocator_unlock(allocator->shared);
+}
+
+// Find the cache of the calling thread
+//
+// Returns NULL if the thread has not allocated from this allocator yet.
+static allocator_cache *allocator_thread_cache_find(ds_allocator *allocator) {
+    ds_allocator_shared *shared = allocator->shared;
+
+    for (unsigned int i = 0; i < DS_AL_MAX_THREAD_CACHES; i++) {
+        allocator_cache_slot *slot = &allocator_cache_slots[i];
+        if (slot->shared == shared && slot->id == shared->id) {
+            return slot->cache;
+        }
+    }
+
+    return NULL;
+}
+
+// Find the cache of the calling thread, creating it on first use
+//
+// Returns NULL if the thread already uses DS_AL_MAX_THREAD_CACHES concurrent
+// allocators or if the cache could not be allocated.
+static allocator_cache *allocator_thread_cache(ds_allocator *allocator) {
+    allocator_cache *cache = allocator_thread_cache_find(allocator);
+    if (cache != NULL) {
+        return cache;
+    }
+
+    // A slot whose allocator was initialized again at the same address is
+    // stale and can be reused
+    ds_allocator_shared *shared = allocator->shared;
+    allocator_cache_slot *empty = NULL;
+    for (unsigned int i = 0; i < DS_AL_MAX_THREAD_CACHES; i++) {
+        allocator_cache_slot *slot = &allocator_cache_slots[i];
+        if (slot->shared == NULL || slot->shared == shared) {
+            empty = slot;
+            break;
+        }
+    }
+
+    if (empty == NULL) {
+        return NULL;
+    }
+
+    cache = allocator_shared_alloc(allocator, sizeof(allocator_cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < ALLOCATOR_SIZE_CLASSES; i++) {
+        cache->free[i] = NULL;
+    }
+    cache->remote = NULL;
+
+    empty->shared = shared;
+    empty->id = shared->id;
+    empty->cache = cache;
+
+    return cache;
+}
+
+// Move the blocks freed by other threads into the local free lists
+static void allocator_cache_drain(allocator_cache *cache) {
+    void *ptr = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (ptr != NULL) {
+        void *next = allocator_cache_next(ptr);
+        unsigned int size_class = allocator_cache_header_of(ptr)->size_class;
+
+        allocator_cache_set_next(ptr, cache->free[size_class]);
+        cache->free[size_class] = ptr;
+
+        ptr = next;
+    }
+}
+
+// Carve a batch of blocks of one size class out of the shared memory block
+static int allocator_cache_refill(ds_allocator *allocator,
+                                  allocator_cache *cache,
+                                  unsigned int size_class) {
+    uint64_t unit = ALLOCATOR_CACHE_HEADER_SIZE + allocator_class_size(size_class);
+    uint64_t count = ALLOCATOR_CACHE_BATCH / unit;
+    if (count == 0) {
+        count = 1;
+    }
+
+    uint8_t *batch = allocator_shared_alloc(allocator, count * unit);
+    if (batch == NULL) {
+        return 1;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        allocator_cache_header *header = (allocator_cache_header *)(batch + i * unit);
+        header->owner = cache;
+        header->size_class = size_class;
+        header->reserved = 0;
+
+        void *ptr = (uint8_t *)header + ALLOCATOR_CACHE_HEADER_SIZE;
+        allocator_cache_set_next(ptr, cache->free[size_class]);
+        cache->free[size_class] = ptr;
+    }
+
+    return 0;
+}
+
+static void *allocator_concurrent_alloc(ds_allocator *allocator,
+                                        uint64_t size) {
+    unsigned int size_class = allocator_size_class(size);
+    allocator_cache *cache = NULL;
+
+    if (size_class < ALLOCATOR_SIZE_CLASSES) {
+        cache = allocator_thread_cache(allocator);
+    }
+
+    if (cache == NULL) {
+        uint8_t *ptr =
+            allocator_shared_alloc(allocator, size + ALLOCATOR_CACHE_HEADER_SIZE);
+        if (ptr == NULL) {
+            return NULL;
+        }
+
+        allocator_cache_header *header = (allocator_cache_header *)ptr;
+        header->owner = NULL;
+        header->size_class = ALLOCATOR_CLASS_LARGE;
+        header->reserved = 0;
 
-    ds_dynamic_array *keys = ht->keys + index;
-    ds_dynamic_array *values = ht->values + index;
+        return ptr + ALLOCATOR_CACHE_HEADER_SIZE;
+    }
 
-    for (unsigned int i = 0; i < keys->count; i++) {
-        void *k = NULL;
-        ds_dynamic_array_get_ref(keys, i, &k);
+    if (cache->free[size_class] == NULL) {
+        allocator_cache_drain(cache);
+    }
 
-        if (ht->compare(k, key) == 0) {
-            ds_dynamic_array_get(values, i, value);
-            return_defer(0);
-        }
+    if (cache->free[size_class] == NULL &&
+        allocator_cache_refill(allocator, cache, size_class) != 0) {
+        return NULL;
     }
 
-    return_defer(1);
+    void *ptr = cache->free[size_class];
+    cache->free[size_class] = allocator_cache_next(ptr);
 
-defer:
-    return result;
+    return ptr;
 }
 
-// Get a reference to an item from the hash table
-//
-// Returns 0 if the item was retrieved successfully, 1 if the item was not
-// found.
-DSHDEF int ds_hash_table_get_ref(ds_hash_table *ht, const void *key,
-                                 void **value) {
-    int result = 0;
+static void allocator_concurrent_free(ds_allocator *allocator, void *ptr) {
+    allocator_cache_header *header = allocator_cache_header_of(ptr);
+    allocator_cache *owner = header->owner;
 
-    unsigned int index = ht->hash(key) % ht->capacity;
+    if (owner == NULL) {
+        allocator_shared_free(allocator, header);
+        return;
+    }
 
-    ds_dynamic_array *keys = ht->keys + index;
-    ds_dynamic_array *values = ht->values + index;
+    unsigned int size_class = header->size_class;
+    if (owner == allocator_thread_cache_find(allocator)) {
+        allocator_cache_set_next(ptr, owner->free[size_class]);
+        owner->free[size_class] = ptr;
+        return;
+    }
 
-    for (unsigned int i = 0; i < keys->count; i++) {
-        void *k = NULL;
-        ds_dynamic_array_get_ref(keys, i, &k);
+    void *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        allocator_cache_set_next(ptr, head);
+    } while (!__atomic_compare_exchange_n(&owner->remote, &head, ptr, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-        if (ht->compare(k, key) == 0) {
-            ds_dynamic_array_get_ref(values, i, value);
-            return_defer(0);
-        }
+// Initialize the allocator so it can be shared between threads
+//
+// The start parameter is the start of the memory block to allocate from, and
+// the size parameter is the maximum size of the memory allocator. The shared
+// state of the allocator and the caches of the threads that use it live in
+// the memory block itself. The caches are not released when a thread exits,
+// so use it with long lived worker threads.
+DSHDEF void ds_allocator_init_concurrent(ds_allocator *allocator,
+                                         uint8_t *start, uint64_t size) {
+    ds_allocator_init(allocator, start, size);
+
+    if (allocator->size < block_align(sizeof(ds_allocator_shared))) {
+        allocator->size = 0;
+        return;
     }
 
-    return_defer(1);
+    ds_allocator_shared *shared = (ds_allocator_shared *)allocator->start;
+    shared->id = __atomic_add_fetch(&allocator_shared_next_id, 1,
+                                    __ATOMIC_RELAXED);
+    shared->lock = 0;
 
-defer:
-    return result;
+    uint64_t reserved = block_align(sizeof(ds_allocator_shared));
+    allocator->start += reserved;
+    allocator->top = allocator->start;
+    allocator->size -= reserved;
+    allocator->shared = shared;
 }
 
-// Get the number of items in the hash table
+// Allocate memory from the allocator
 //
-// Returns the number of items in the hash table.
-DSHDEF unsigned int ds_hash_table_count(ds_hash_table *ht) {
-    unsigned int count = 0;
-    for (unsigned int i = 0; i < ht->capacity; i++) {
-        count += (ht->keys + i)->count;
+// This function allocates memory from the allocator. If the allocator is unable
+// to allocate the memory, it returns NULL.
+DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, uint64_t size) {
+    if (allocator->shared != NULL) {
+        return allocator_concurrent_alloc(allocator, size);
     }
-    return count;
-}
 
-// Remove an item from the hash table
-//
-// Returns 0 if the item was removed successfully, 1 if the item was not found.
-DSHDEF int ds_hash_table_remove(ds_hash_table *ht, const void *key) {
-    (void)ht;
-    (void)key;
-    DS_LOG_ERROR("Not implemented");
-    return 1;
+    return allocator_arena_alloc(allocator, size);
 }
 
-// Free the hash table
+// Free memory from the allocator
 //
-// This function frees all the memory used by the hash table.
-DSHDEF void ds_hash_table_free(ds_hash_table *ht) {
-    for (unsigned int i = 0; i < ht->capacity; i++) {
-        ds_dynamic_array_free(ht->keys + i);
-        ds_dynamic_array_free(ht->values + i);
+// This function frees memory from the allocator. If the pointer is not within
+// the bounds of the allocator, it does nothing.
+DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
+    if (allocator->shared != NULL) {
+        // The top moves under the lock, so check against the whole block
+        if ((uint8_t *)ptr >= allocator->start + allocator->size ||
+            (uint8_t *)ptr < allocator->start) {
+            return;
+        }
+        allocator_concurrent_free(allocator, ptr);
+        return;
     }
-    DS_FREE(NULL, ht->keys);
-    DS_FREE(NULL, ht->values);
+
+    allocator_arena_free(allocator, ptr);
 }
 
-#endif // DS_HT_IMPLEMENTATION
+// Compute the fragmentation of the free space in the allocator
+//
+// The fragmentation is 1 - largest_free / total_free, where the unused space
+// after the last block counts as one free region. It is 0 when all the free
+// space is contiguous (or there is none) and approaches 1 as the free space is
+// split into many small blocks.
+DSHDEF double ds_allocator_fragmentation(ds_allocator *allocator) {
+    uint8_t *ptr = allocator->start;
+    uint64_t total_free = 0;
+    uint64_t largest_free = 0;
 
-#ifdef DS_AL_IMPLEMENTATION
+    while (ptr < allocator->top) {
+        uint64_t size = block_size(ptr);
 
-static void uint64_read_le(uint8_t *data, uint64_t *value) {
-    *value = ((uint64_t)data[0] << 0) | ((uint64_t)data[1] << 8) |
-             ((uint64_t)data[2] << 16) | ((uint64_t)data[3] << 24) |
-             ((uint64_t)data[4] << 32) | ((uint64_t)data[5] << 40) |
-             ((uint64_t)data[6] << 48) | ((uint64_t)data[7] << 56);
-}
+        if (block_free(ptr)) {
+            total_free += size;
+            if (size > largest_free) {
+                largest_free = size;
+            }
+        }
 
-static void uint64_write_le(uint8_t *data, uint64_t value) {
-    data[0] = (value >> 0) & 0xff;
-    data[1] = (value >> 8) & 0xff;
-    data[2] = (value >> 16) & 0xff;
-    data[3] = (value >> 24) & 0xff;
-    data[4] = (value >> 32) & 0xff;
-    data[5] = (value >> 40) & 0xff;
-    data[6] = (value >> 48) & 0xff;
-    data[7] = (value >> 56) & 0xff;
-}
+        ptr += size + BLOCK_METADATA_SIZE;
+    }
 
-static void uint32_read_le(uint8_t *data, uint32_t *value) {
-    *value = ((uint32_t)data[0] << 0) | ((uint32_t)data[1] << 8) |
-             ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
-}
+    uint64_t tail = allocator->size - (uint64_t)(allocator->top - allocator->start);
+    total_free += tail;
+    if (tail > largest_free) {
+        largest_free = tail;
+    }
 
-static void uint32_write_le(uint8_t *data, uint32_t value) {
-    data[0] = (value >> 0) & 0xff;
-    data[1] = (value >> 8) & 0xff;
-    data[2] = (value >> 16) & 0xff;
-    data[3] = (value >> 24) & 0xff;
+    if (total_free == 0) {
+        return 0.0;
+    }
+
+    return 1.0 - (double)largest_free / (double)total_free;
 }
 
-#define BLOCK_METADATA_SIZE 28
-#define BLOCK_INDEX_UNDEFINED -1
+#ifdef DS_AL_STATS
 
 /*
- * | prev | next | size | free | ... size bytes of data ... |
+ * | size | site | ... size bytes of data ... |
  */
-typedef struct block {
-        int64_t prev;  // 8 bytes
-        int64_t next;  // 8 bytes
+typedef struct allocator_stats_header {
         uint64_t size; // 8 bytes
-        uint32_t free; // 4 bytes
-        uint8_t *data; // 8 bytes
-} block_t;
+        uint64_t site; // 8 bytes
+} allocator_stats_header;
 
-static void block_read(uint8_t *data, block_t *block) {
-    uint64_read_le(data + 0, (uint64_t *)&block->prev);
-    uint64_read_le(data + 8, (uint64_t *)&block->next);
-    uint64_read_le(data + 16, &block->size);
-    uint32_read_le(data + 24, &block->free);
-    block->data = data + BLOCK_METADATA_SIZE;
-}
+#define ALLOCATOR_STATS_HEADER_SIZE sizeof(allocator_stats_header)
 
-static void block_write(uint8_t *data, block_t *block) {
-    uint64_write_le(data + 0, block->prev);
-    uint64_write_le(data + 8, block->next);
-    uint64_write_le(data + 16, block->size);
-    uint32_write_le(data + 24, block->free);
-}
+// The last slot collects the call sites that did not fit in the table
+static ds_allocator_stats_site allocator_stats_sites[DS_AL_STATS_MAX_SITES + 1];
+static ds_allocator_stats allocator_stats = {0};
+static uint64_t allocator_stats_last_allocs = 0;
+static uint64_t allocator_stats_last_bytes = 0;
 
-// Initialize the allocator
-//
-// The start parameter is the start of the memory block to allocate from, and
-// the size parameter is the maximum size of the memory allocator.
-DSHDEF void ds_allocator_init(ds_allocator *allocator, uint8_t *start,
-                              uint64_t size) {
-    allocator->start = start;
-    allocator->prev = NULL;
-    allocator->top = start;
-    allocator->size = size;
+static uint64_t allocator_stats_load(uint64_t *value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
 }
 
-// Dump the allocator to stdout
-//
-// This function prints the contents of the allocator to stdout.
-DSHDEF void ds_allocator_dump(ds_allocator *allocator) {
-    block_t block = {0};
-    uint8_t *ptr = allocator->start;
-
-    fprintf(stdout, "%*s %*s %*s %*s %*s\n", 14, "", 14, "prev", 14, "next", 14,
-            "size", 14, "free");
-
-    while (ptr < allocator->top) {
-        block_read(ptr, &block);
-
-        uint8_t *prev = (block.prev == BLOCK_INDEX_UNDEFINED)
-                            ? NULL
-                            : allocator->start + block.prev;
-        uint8_t *next = (block.next == BLOCK_INDEX_UNDEFINED)
-                            ? NULL
-                            : allocator->start + block.next;
-
-        fprintf(stdout, "%*p %*p %*p %*lu %*u\n", 14, ptr, 14, prev, 14, next,
-                14, block.size, 14, block.free);
+static void allocator_stats_add(uint64_t *value, uint64_t delta) {
+    __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
 
-        ptr += (block.size + BLOCK_METADATA_SIZE);
-    }
+static void allocator_stats_sub(uint64_t *value, uint64_t delta) {
+    __atomic_fetch_sub(value, delta, __ATOMIC_RELAXED);
 }
 
-static int allocator_find_block(ds_allocator *allocator, uint64_t size,
-                                block_t *block) {
-    if (allocator->prev == NULL) {
-        return 0;
-    }
+static uint64_t allocator_stats_site_index(const char *site,
+                                           const char *function) {
+    uint64_t hash = ((uint64_t)(uintptr_t)site >> 3) * 0x9e3779b97f4a7c15ULL;
 
-    block_t current = {0};
-    uint8_t *ptr = allocator->start;
+    for (uint64_t i = 0; i < DS_AL_STATS_MAX_SITES; i++) {
+        uint64_t index = (hash + i) % DS_AL_STATS_MAX_SITES;
+        ds_allocator_stats_site *item = &allocator_stats_sites[index];
 
-    while (ptr < allocator->top) {
-        block_read(ptr, &current);
+        const char *current = __atomic_load_n(&item->site, __ATOMIC_ACQUIRE);
+        if (current == site) {
+            return index;
+        }
 
-        if (current.free && current.size >= size + BLOCK_METADATA_SIZE * 2) {
-            uint64_t old_size = current.size;
-            int64_t old_next = current.next;
+        if (current == NULL) {
+            const char *expected = NULL;
+            if (__atomic_compare_exchange_n(&item->site, &expected, site, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                item->function = function;
+                return index;
+            }
 
-            block_t split = {0};
-            split.prev = (uint64_t)(ptr - allocator->start);
-            split.next = old_next;
-            split.size = old_size - size - BLOCK_METADATA_SIZE;
-            split.free = 1;
-            split.data = ptr + BLOCK_METADATA_SIZE + size + BLOCK_METADATA_SIZE;
+            if (expected == site) {
+                return index;
+            }
+        }
+    }
 
-            block_write(ptr + BLOCK_METADATA_SIZE + size, &split);
+    return DS_AL_STATS_MAX_SITES;
+}
 
-            *block = current;
-            block->next =
-                (uint64_t)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
-            block->size = size;
-            block->free = 0;
-            block->data = ptr + BLOCK_METADATA_SIZE;
+static void allocator_stats_record_alloc(uint64_t index, uint64_t size) {
+    ds_allocator_stats_site *item = &allocator_stats_sites[index];
 
-            block_write(ptr, block);
+    allocator_stats_add(&item->allocs, 1);
+    allocator_stats_add(&item->bytes, size);
+    allocator_stats_add(&item->live_bytes, size);
 
-            block_t next = {0};
-            block_read(allocator->start + old_next, &next);
+    allocator_stats_add(&allocator_stats.allocs, 1);
+    allocator_stats_add(&allocator_stats.bytes, size);
+    uint64_t live =
+        __atomic_add_fetch(&allocator_stats.live_bytes, size, __ATOMIC_RELAXED);
 
-            next.prev =
-                (uint64_t)(ptr - allocator->start) + BLOCK_METADATA_SIZE + size;
+    uint64_t peak = allocator_stats_load(&allocator_stats.peak_bytes);
+    while (live > peak &&
+           !__atomic_compare_exchange_n(&allocator_stats.peak_bytes, &peak,
+                                        live, 1, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
 
-            block_write(allocator->start + old_next, &next);
+static void allocator_stats_record_free(uint64_t index, uint64_t size) {
+    ds_allocator_stats_site *item = &allocator_stats_sites[index];
 
-            return 1;
-        }
+    allocator_stats_add(&item->frees, 1);
+    allocator_stats_sub(&item->live_bytes, size);
 
-        if (current.free && current.size >= size) {
-            *block = current;
-            block->free = 0;
+    allocator_stats_add(&allocator_stats.frees, 1);
+    allocator_stats_sub(&allocator_stats.live_bytes, size);
+}
 
-            block_write(ptr, block);
+// Allocate memory and record it under the given call site
+//
+// This is what DS_MALLOC expands to when DS_AL_STATS is defined. The memory is
+// allocated with the underlying allocator together with a small header that
+// remembers the size and the call site of the allocation.
+DSHDEF void *ds_allocator_stats_malloc(void *a, uint64_t size, const char *site,
+                                       const char *function) {
+    uint8_t *ptr =
+        ds_allocator_stats_raw_malloc(a, size + ALLOCATOR_STATS_HEADER_SIZE);
+    if (ptr == NULL) {
+        return NULL;
+    }
 
-            return 1;
-        }
+    allocator_stats_header header = {0};
+    header.size = size;
+    header.site = allocator_stats_site_index(site, function);
+    DS_MEMCPY(ptr, &header, ALLOCATOR_STATS_HEADER_SIZE);
 
-        ptr += (current.size + BLOCK_METADATA_SIZE);
-    }
+    allocator_stats_record_alloc(header.site, size);
 
-    return 0;
+    return ptr + ALLOCATOR_STATS_HEADER_SIZE;
 }
 
-// Allocate memory from the allocator
+// Reallocate memory and record it under the given call site
 //
-// This function allocates memory from the allocator. If the allocator is unable
-// to allocate the memory, it returns NULL.
-DSHDEF void *ds_allocator_alloc(ds_allocator *allocator, uint64_t size) {
-    block_t block = {0};
-    if (allocator_find_block(allocator, size, &block) != 0) {
-        return block.data;
+// This is what DS_REALLOC expands to when DS_AL_STATS is defined. The old
+// allocation is accounted as freed and the new one is attributed to the site
+// of the reallocation.
+DSHDEF void *ds_allocator_stats_realloc(void *a, void *ptr, uint64_t old_size,
+                                        uint64_t new_size, const char *site,
+                                        const char *function) {
+    (void)old_size;
+
+    if (ptr == NULL) {
+        return ds_allocator_stats_malloc(a, new_size, site, function);
     }
 
-    if (allocator->top + size + BLOCK_METADATA_SIZE >
-        allocator->start + allocator->size) {
+    uint8_t *base = (uint8_t *)ptr - ALLOCATOR_STATS_HEADER_SIZE;
+    allocator_stats_header header = {0};
+    DS_MEMCPY(&header, base, ALLOCATOR_STATS_HEADER_SIZE);
+
+    uint8_t *new_base = ds_allocator_stats_raw_realloc(
+        a, base, header.size + ALLOCATOR_STATS_HEADER_SIZE,
+        new_size + ALLOCATOR_STATS_HEADER_SIZE);
+    if (new_base == NULL) {
         return NULL;
     }
 
-    block.next = BLOCK_INDEX_UNDEFINED;
-    block.size = size;
-    block.free = 0;
-    block.data = allocator->top + BLOCK_METADATA_SIZE;
+    allocator_stats_record_free(header.site, header.size);
 
-    if (allocator->prev == NULL) {
-        block.prev = BLOCK_INDEX_UNDEFINED;
-    } else {
-        block.prev = (uint64_t)(allocator->prev - allocator->start);
+    header.size = new_size;
+    header.site = allocator_stats_site_index(site, function);
+    DS_MEMCPY(new_base, &header, ALLOCATOR_STATS_HEADER_SIZE);
 
-        block_t prev = {0};
-        block_read(allocator->prev, &prev);
-        prev.next = (uint64_t)(allocator->top - allocator->start);
+    allocator_stats_record_alloc(header.site, new_size);
 
-        block_write(allocator->prev, &prev);
+    return new_base + ALLOCATOR_STATS_HEADER_SIZE;
+}
+
+// Free memory that was allocated through the stats layer
+//
+// This is what DS_FREE expands to when DS_AL_STATS is defined.
+DSHDEF void ds_allocator_stats_free(void *a, void *ptr) {
+    if (ptr == NULL) {
+        return;
     }
 
-    block_write(allocator->top, &block);
+    uint8_t *base = (uint8_t *)ptr - ALLOCATOR_STATS_HEADER_SIZE;
+    allocator_stats_header header = {0};
+    DS_MEMCPY(&header, base, ALLOCATOR_STATS_HEADER_SIZE);
 
-    allocator->prev = allocator->top;
-    allocator->top += size + BLOCK_METADATA_SIZE;
+    allocator_stats_record_free(header.site, header.size);
 
-    return block.data;
+    ds_allocator_stats_raw_free(a, base);
 }
 
-// Free memory from the allocator
+// Mark the end of a tick
 //
-// This function frees memory from the allocator. If the pointer is not within
-// the bounds of the allocator, it does nothing.
-DSHDEF void ds_allocator_free(ds_allocator *allocator, void *ptr) {
-    if ((uint8_t *)ptr > allocator->top || (uint8_t *)ptr < allocator->start) {
-        return;
+// The allocations made since the previous call are accounted to the tick that
+// just ended. Call it once per iteration of the main loop.
+DSHDEF void ds_allocator_stats_tick(void) {
+    uint64_t allocs = allocator_stats_load(&allocator_stats.allocs);
+    uint64_t bytes = allocator_stats_load(&allocator_stats.bytes);
+
+    allocator_stats.tick_allocs = allocs - allocator_stats_last_allocs;
+    allocator_stats.tick_bytes = bytes - allocator_stats_last_bytes;
+    if (allocator_stats.tick_allocs > allocator_stats.max_tick_allocs) {
+        allocator_stats.max_tick_allocs = allocator_stats.tick_allocs;
+    }
+    if (allocator_stats.tick_bytes > allocator_stats.max_tick_bytes) {
+        allocator_stats.max_tick_bytes = allocator_stats.tick_bytes;
     }
+    allocator_stats.ticks++;
 
-    block_t block = {0};
-    block_read(ptr - BLOCK_METADATA_SIZE, &block);
-    block.free = 1;
+    allocator_stats_last_allocs = allocs;
+    allocator_stats_last_bytes = bytes;
+}
 
-    if (block.prev != BLOCK_INDEX_UNDEFINED) {
-        block_t prev = {0};
-        block_read(allocator->start + block.prev, &prev);
+// Get a snapshot of the global allocator stats
+DSHDEF void ds_allocator_stats_get(ds_allocator_stats *stats) {
+    stats->live_bytes = allocator_stats_load(&allocator_stats.live_bytes);
+    stats->peak_bytes = allocator_stats_load(&allocator_stats.peak_bytes);
+    stats->allocs = allocator_stats_load(&allocator_stats.allocs);
+    stats->frees = allocator_stats_load(&allocator_stats.frees);
+    stats->bytes = allocator_stats_load(&allocator_stats.bytes);
+    stats->ticks = allocator_stats.ticks;
+    stats->tick_allocs = allocator_stats.tick_allocs;
+    stats->tick_bytes = allocator_stats.tick_bytes;
+    stats->max_tick_allocs = allocator_stats.max_tick_allocs;
+    stats->max_tick_bytes = allocator_stats.max_tick_bytes;
+}
 
-        if (prev.free) {
-            prev.next = block.next;
-            prev.size += block.size + BLOCK_METADATA_SIZE;
+// Write the allocator stats as JSON into the string builder
+//
+// The report holds the global counters, the allocations per tick and one entry
+// per call site. If an allocator is given, its fragmentation ratio is included
+// as well. The stats are captured before anything is appended, so the report
+// does not account for its own allocations.
+//
+// Returns 0 if the report was written successfully.
+DSHDEF int ds_allocator_stats_report(ds_string_builder *sb,
+                                     ds_allocator *allocator) {
+    int result = 0;
 
-            uint8_t *mptr = allocator->start + block.prev;
+    ds_allocator_stats stats = {0};
+    ds_allocator_stats_get(&stats);
 
-            block_t next = {0};
-            block_read(allocator->start + block.next, &next);
+    ds_allocator_stats_site sites[DS_AL_STATS_MAX_SITES + 1];
+    unsigned int count = 0;
+    for (unsigned int i = 0; i <= DS_AL_STATS_MAX_SITES; i++) {
+        ds_allocator_stats_site *item = &allocator_stats_sites[i];
+        const char *site = __atomic_load_n(&item->site, __ATOMIC_ACQUIRE);
+        uint64_t allocs = allocator_stats_load(&item->allocs);
+        if (site == NULL && allocs == 0) {
+            continue;
+        }
 
-            next.prev = (uint64_t)((uint8_t *)mptr - allocator->start);
+        sites[count].site = (site != NULL) ? site : "<other>";
+        sites[count].function = (item->function != NULL) ? item->function : "";
+        sites[count].allocs = allocs;
+        sites[count].frees = allocator_stats_load(&item->frees);
+        sites[count].bytes = allocator_stats_load(&item->bytes);
+        sites[count].live_bytes = allocator_stats_load(&item->live_bytes);
+        count++;
+    }
+
+    double ticks = (stats.ticks > 0) ? (double)stats.ticks : 1.0;
+
+    if (ds_string_builder_append(
+            sb,
+            "{\"live_bytes\":%llu,\"peak_bytes\":%llu,\"allocs\":%llu,"
+            "\"frees\":%llu,\"bytes\":%llu,\"ticks\":%llu,",
+            (unsigned long long)stats.live_bytes,
+            (unsigned long long)stats.peak_bytes,
+            (unsigned long long)stats.allocs, (unsigned long long)stats.frees,
+            (unsigned long long)stats.bytes,
+            (unsigned long long)stats.ticks) != 0) {
+        return_defer(1);
+    }
 
-            block_write(allocator->start + block.next, &next);
-            block_write(allocator->start + block.prev, &prev);
+    if (ds_string_builder_append(
+            sb,
+            "\"allocs_per_tick\":{\"last\":%llu,\"max\":%llu,\"mean\":%.3f},"
+            "\"bytes_per_tick\":{\"last\":%llu,\"max\":%llu,\"mean\":%.3f},",
+            (unsigned long long)stats.tick_allocs,
+            (unsigned long long)stats.max_tick_allocs, stats.allocs / ticks,
+            (unsigned long long)stats.tick_bytes,
+            (unsigned long long)stats.max_tick_bytes,
+            stats.bytes / ticks) != 0) {
+        return_defer(1);
+    }
 
-            block = prev;
-            ptr = mptr + BLOCK_METADATA_SIZE;
+    if (allocator != NULL) {
+        if (ds_string_builder_append(sb, "\"fragmentation\":%.6f,",
+                                     ds_allocator_fragmentation(allocator)) !=
+            0) {
+            return_defer(1);
         }
     }
 
-    if (block.next != BLOCK_INDEX_UNDEFINED) {
-        block_t next = {0};
-        block_read(allocator->start + block.next, &next);
-
-        if (next.free) {
-            block_t next_next = {0};
-            block_read(allocator->start + next.next, &next_next);
-
-            uint8_t *mptr = ptr - BLOCK_METADATA_SIZE;
-
-            next_next.prev = (uint64_t)((uint8_t *)mptr - allocator->start);
-
-            block_write(allocator->start + next.next, &next_next);
+    if (ds_string_builder_append(sb, "\"sites\":[") != 0) {
+        return_defer(1);
+    }
 
-            block.next = next.next;
-            block.size += next.size + BLOCK_METADATA_SIZE;
+    for (unsigned int i = 0; i < count; i++) {
+        if (ds_string_builder_append(
+                sb,
+                "%s{\"site\":\"%s\",\"function\":\"%s\",\"allocs\":%llu,"
+                "\"frees\":%llu,\"bytes\":%llu,\"live_bytes\":%llu}",
+                (i > 0) ? "," : "", sites[i].site, sites[i].function,
+                (unsigned long long)sites[i].allocs,
+                (unsigned long long)sites[i].frees,
+                (unsigned long long)sites[i].bytes,
+                (unsigned long long)sites[i].live_bytes) != 0) {
+            return_defer(1);
         }
     }
 
-    block_write(ptr - BLOCK_METADATA_SIZE, &block);
+    if (ds_string_builder_append(sb, "]}\n") != 0) {
+        return_defer(1);
+    }
+
+defer:
+    return result;
 }
 
+#endif // DS_AL_STATS
+
 #endif // DS_AL_IMPLEMENTATION
 
 #ifdef DS_AP_IMPLEMENTATION
@@ -2393,7 +3874,7 @@ void ds_argparse_print_version(ds_argparse_parser *parser) {
 //
 // Arguments:
 // - parser: argument parser
-void ds_argparse_free(ds_argparse_parser *parser) {
+void ds_argparse_parser_free(ds_argparse_parser *parser) {
     ds_dynamic_array_free(&parser->arguments);
 }
 
@@ -2401,6 +3882,11 @@ void ds_argparse_free(ds_argparse_parser *parser) {
 
 #ifdef DS_IO_IMPLEMENTATION
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // Read a file
 //
 // Reads the contents of a file into a buffer.
@@ -2508,4 +3994,101 @@ defer:
     return result;
 }
 
+// Map a file into memory
+//
+// Maps the contents of a file into memory with a private, copy on write
+// mapping. If the file cannot be mapped, it is read with a single buffer
+// sized from fstat instead. Release it with ds_io_unmap_file.
+//
+// Arguments:
+// - filename: name of the file to map
+// - mapping: the mapped data, its length and how it was loaded
+//
+// Returns:
+// - 0 if the file was mapped successfully, -1 otherwise
+DSHDEF int ds_io_map_file(const char *filename, ds_io_mapping *mapping) {
+    int result = 0;
+    int fd = -1;
+
+    mapping->data = NULL;
+    mapping->length = 0;
+    mapping->mapped = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        DS_LOG_ERROR("Failed to open file: %s", filename);
+        return_defer(-1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        DS_LOG_ERROR("Failed to stat file: %s", filename);
+        return_defer(-1);
+    }
+
+    if ((uint64_t)st.st_size > (unsigned int)-1) {
+        DS_LOG_ERROR("File too large: %s", filename);
+        return_defer(-1);
+    }
+
+    mapping->length = (unsigned int)st.st_size;
+    if (mapping->length == 0) {
+        return_defer(0);
+    }
+
+    void *data = mmap(NULL, mapping->length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+        madvise(data, mapping->length, MADV_SEQUENTIAL);
+        mapping->data = data;
+        mapping->mapped = 1;
+        return_defer(0);
+    }
+
+    mapping->data = DS_MALLOC(NULL, mapping->length);
+    if (mapping->data == NULL) {
+        DS_LOG_ERROR("Failed to allocate buffer for file: %s", filename);
+        return_defer(-1);
+    }
+
+    unsigned int total = 0;
+    while (total < mapping->length) {
+        ssize_t n = read(fd, mapping->data + total, mapping->length - total);
+        if (n <= 0) {
+            DS_LOG_ERROR("Failed to read file: %s", filename);
+            return_defer(-1);
+        }
+        total += n;
+    }
+
+defer:
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (result != 0) {
+        ds_io_unmap_file(mapping);
+    }
+    return result;
+}
+
+// Unmap a file
+//
+// Releases the memory of a file mapped with ds_io_map_file.
+//
+// Arguments:
+// - mapping: the mapping to release
+DSHDEF void ds_io_unmap_file(ds_io_mapping *mapping) {
+    if (mapping->data != NULL) {
+        if (mapping->mapped) {
+            munmap(mapping->data, mapping->length);
+        } else {
+            DS_FREE(NULL, mapping->data);
+        }
+    }
+
+    mapping->data = NULL;
+    mapping->length = 0;
+    mapping->mapped = 0;
+}
+
 #endif // DS_IO_IMPLEMENTATION
@@ -1,14 +1,33 @@
 #include <limits.h>
-#include <ctype.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+
+// The containers that are given a ds_allocator take their memory from it, and
+// from the heap once it is full. The others use the heap.
+void *memory_alloc(void *allocator, uint64_t size);
+void *memory_realloc(void *allocator, void *ptr, uint64_t old_size, uint64_t new_size);
+void memory_free(void *allocator, void *ptr);
+#define DS_MALLOC(a, sz) memory_alloc(a, sz)
+#define DS_REALLOC(a, ptr, old_sz, new_sz) memory_realloc(a, ptr, old_sz, new_sz)
+#define DS_FREE(a, ptr) memory_free(a, ptr)
+
 #define DS_IMPLEMENTATION
 #include "ds.h"
 
-#define MAP_FILE "world.txt"
+#define WORLD_FILE "world.txt"
+#define RMAP_EXTENSION ".rmap"
+#define ALLOC_REPORT_FILE "alloc_report.json"
 
 #define PLAYER_CH '@'
 #define FLOOR_CH '.'
@@ -27,6 +46,7 @@
 #define MAGENTA_COL "\033[35m"
 #define CYAN_COL "\033[36m"
 #define WHITE_COL "\033[37m"
+#define REMEMBERED_COL "\033[90m"
 #define CLEAR_SCREEN_ANSI "\e[1;1H\e[2J"
 
 #define PLAYER_COL YELLOW_COL
@@ -49,26 +69,113 @@
 
 typedef char tile_kind;
 
-void tile_kind_print(tile_kind t) {
-    if (t == FLOOR_CH) {
-        printf("%s%c%s", FLOOR_COL, t, RESET_COL);
-    } else if (t == WALL_CH) {
-        printf("%s%c%s", WALL_COL, t, RESET_COL);
-    } else if (t == TREE_CH) {
-        printf("%s%c%s", TREE_COL, t, RESET_COL);
-    } else if (t == DOOR_CH) {
-        printf("%s%c%s", DOOR_COL, t, RESET_COL);
-    } else if (t == KEY_CH) {
-        printf("%s%c%s", KEY_COL, t, RESET_COL);
-    } else if (t == GOLD_CH) {
-        printf("%s%c%s", GOLD_COL, t, RESET_COL);
+typedef struct inventory {
+    unsigned int keys;
+    unsigned int gold;
+} inventory;
+
+// MEMORY
+//
+// The DS_MALLOC, DS_REALLOC and DS_FREE hooks declared at the top. A block
+// belongs to the allocator if it lies in its memory block, anything else
+// came from the heap.
+int memory_owns(ds_allocator *allocator, void *ptr) {
+    return (uint8_t *)ptr >= allocator->start &&
+           (uint8_t *)ptr < allocator->start + allocator->size;
+}
+
+void *memory_alloc(void *allocator, uint64_t size) {
+    void *ptr = NULL;
+    if (allocator != NULL) {
+        ptr = ds_allocator_alloc((ds_allocator *)allocator, size);
+    }
+    return ptr != NULL ? ptr : malloc(size);
+}
+
+void *memory_realloc(void *allocator, void *ptr, uint64_t old_size, uint64_t new_size) {
+    // A block from the heap stays on the heap
+    if (allocator == NULL || (ptr != NULL && !memory_owns((ds_allocator *)allocator, ptr))) {
+        return realloc(ptr, new_size);
+    }
+
+    void *new_ptr = memory_alloc(allocator, new_size);
+    if (new_ptr != NULL && ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        memory_free(allocator, ptr);
+    }
+    return new_ptr;
+}
+
+void memory_free(void *allocator, void *ptr) {
+    if (allocator != NULL && ptr != NULL && memory_owns((ds_allocator *)allocator, ptr)) {
+        ds_allocator_free((ds_allocator *)allocator, ptr);
     } else {
+        free(ptr);
+    }
+}
+
+// TILE PROPERTIES
+//
+// Everything the game needs to know about a tile kind is stored in a table
+// indexed by the tile character, so a query is a single load and adding a
+// tile kind only needs a new row. Characters that are not in the table have
+// no flags and can not be printed.
+#define TILE_SOLID (1 << 0)      // can not be walked on
+#define TILE_OPAQUE (1 << 1)     // blocks the line of sight
+#define TILE_DOOR (1 << 2)       // opens with a key
+#define TILE_PICKUP (1 << 3)     // adds one to a counter of the inventory
+#define TILE_PLAYER (1 << 4)     // start of the player in a text map
+#define TILE_ENEMY (1 << 5)      // start of an enemy in a text map
+#define TILE_LINE_BREAK (1 << 6) // end of a row in a text map
+
+typedef struct tile_props {
+    uint8_t flags;
+    uint8_t glyph_length; // 0 if the tile can not be printed
+    uint8_t pickup;       // offset of the counter in the inventory
+    tile_kind becomes;    // the tile left behind by a door or a pickup
+    char glyph[12];       // color escape, character and reset escape
+    uint8_t memory_length;
+    char memory[12];      // the glyph of a tile that is remembered, not seen
+} tile_props;
+
+#define TILE_PROPS(ch, str, col, ...)                                          \
+    [(unsigned char)(ch)] = {.glyph = col str RESET_COL,                       \
+                             .glyph_length = sizeof(col str RESET_COL) - 1,    \
+                             .memory = REMEMBERED_COL str RESET_COL,           \
+                             .memory_length =                                  \
+                                 sizeof(REMEMBERED_COL str RESET_COL) - 1,     \
+                             __VA_ARGS__}
+
+const tile_props tile_props_table[256] = {
+    TILE_PROPS(FLOOR_CH, ".", FLOOR_COL, .flags = 0),
+    TILE_PROPS(WALL_CH, "#", WALL_COL, .flags = TILE_SOLID | TILE_OPAQUE),
+    TILE_PROPS(TREE_CH, "&", TREE_COL, .flags = 0),
+    TILE_PROPS(DOOR_CH, "|", DOOR_COL,
+               .flags = TILE_SOLID | TILE_OPAQUE | TILE_DOOR, .becomes = FLOOR_CH),
+    TILE_PROPS(KEY_CH, "-", KEY_COL, .flags = TILE_PICKUP,
+               .pickup = offsetof(inventory, keys), .becomes = FLOOR_CH),
+    TILE_PROPS(GOLD_CH, "$", GOLD_COL, .flags = TILE_PICKUP,
+               .pickup = offsetof(inventory, gold), .becomes = FLOOR_CH),
+    [(unsigned char)PLAYER_CH] = {.flags = TILE_PLAYER},
+    ['A' ... 'Z'] = {.flags = TILE_ENEMY},
+    ['a' ... 'z'] = {.flags = TILE_ENEMY},
+    ['\n'] = {.flags = TILE_LINE_BREAK},
+};
+
+static inline const tile_props *tile_kind_props(tile_kind t) {
+    return &tile_props_table[(unsigned char)t];
+}
+
+void tile_kind_print(ds_string_builder *sb, tile_kind t) {
+    const tile_props *props = tile_kind_props(t);
+    if (props->glyph_length == 0) {
         DS_PANIC("unreachable");
     }
+    ds_string_builder_appendn(sb, props->glyph, props->glyph_length);
 }
 
 int tile_kind_is_impassible(tile_kind t) {
-    return (t == WALL_CH || t == DOOR_CH);
+    return tile_kind_props(t)->flags & TILE_SOLID;
 }
 
 typedef struct uvec2 {
@@ -81,376 +188,4081 @@ typedef struct entity {
     char symbol;
 } entity;
 
-void entity_print(entity e) {
+void entity_print(ds_string_builder *sb, entity e) {
     if (e.symbol == PLAYER_CH) {
-        printf("%s%c%s", PLAYER_COL, PLAYER_CH, RESET_COL);
+        ds_sb_append_literal(sb, PLAYER_COL);
     } else {
-        printf("%s%c%s", ENEMY_COL, e.symbol, RESET_COL);
+        ds_sb_append_literal(sb, ENEMY_COL);
     }
+    ds_string_builder_appendc(sb, e.symbol);
+    ds_sb_append_literal(sb, RESET_COL);
 }
 
-typedef struct inventory {
-    unsigned int keys;
-    unsigned int gold;
-} inventory;
+// ENTITY STORE
+//
+// The enemies are stored as a structure of arrays, one contiguous array per
+// field, so a system that only needs the positions only reads the positions.
+// An entity keeps the id it was added with until it is removed. Removing an
+// entity moves the last entity into its place, and the id to index table is
+// updated to follow it. The ids of removed entities are reused.
+//
+// The store also indexes the entities by position, so that finding the entity
+// on a tile does not have to look at every entity. The map is divided in cells
+// of 8x8 tiles and the cells are hashed into buckets. The entities of a bucket
+// are chained by id, and the number of buckets grows with the number of
+// entities, so a bucket holds about one entity. All the changes of position
+// must go through entity_store_move to keep the index up to date.
+#define ENTITY_NONE UINT32_MAX
+#define ENTITY_CELL_SHIFT 3
+#define ENTITY_MIN_BUCKETS 64
+#define ENTITY_AI_CHASE 0
+#define ENEMY_HP 3
+#define ENEMY_SPEED 12 // energy gained per turn
+#define ENTITY_ACTION_COST 12 // energy spent by an action
 
-void inventory_print(inventory v) {
-    printf(GREEN_COL "Inventory:\n" RESET_COL);
-    printf(KEY_COL "- keys: %d\n" RESET_COL, v.keys);
-    printf(GOLD_COL "- gold: %d\n" RESET_COL, v.gold);
+typedef struct entity_store {
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int *x;
+    unsigned int *y;
+    char *symbol;
+    int *hp;
+    uint8_t *speed;
+    uint8_t *ai_state;
+    int32_t *path; // cached path handle, -1 if there is none
+    uint32_t *id;  // id of the entity at each index
+    ds_dynamic_array /* uint32_t */ index; // index of each id, or ENTITY_NONE
+    ds_dynamic_array /* uint32_t */ free_ids;
+    ds_dynamic_array /* uint32_t */ generation; // of each id, bumped when it is freed
+    uint32_t *buckets; // first id in each bucket, or ENTITY_NONE
+    unsigned int bucket_count;
+    ds_dynamic_array /* uint32_t */ next; // next id in the same bucket
+} entity_store;
+
+void entity_store_init(entity_store *store) {
+    memset(store, 0, sizeof(entity_store));
+    ds_dynamic_array_init(&store->index, sizeof(uint32_t));
+    ds_dynamic_array_init(&store->free_ids, sizeof(uint32_t));
+    ds_dynamic_array_init(&store->generation, sizeof(uint32_t));
+    ds_dynamic_array_init(&store->next, sizeof(uint32_t));
 }
 
-typedef struct world {
-    entity player;
-    inventory inventory;
-    unsigned int width;
-    unsigned int height;
-    ds_dynamic_array /* tile_kind */ tiles;
-    ds_dynamic_array /* entity */ enemies;
-} world_t;
+unsigned int entity_store_bucket(entity_store *store, unsigned int x, unsigned int y) {
+    uint32_t cx = x >> ENTITY_CELL_SHIFT;
+    uint32_t cy = y >> ENTITY_CELL_SHIFT;
+    return ((cx * 0x9e3779b1u) ^ (cy * 0x85ebca77u)) & (store->bucket_count - 1);
+}
 
-void world_free(world_t *world) {
-    ds_dynamic_array_free(&world->tiles);
-    ds_dynamic_array_free(&world->enemies);
+void entity_store_link(entity_store *store, uint32_t id, unsigned int x, unsigned int y) {
+    unsigned int bucket = entity_store_bucket(store, x, y);
+    ((uint32_t *)store->next.items)[id] = store->buckets[bucket];
+    store->buckets[bucket] = id;
 }
 
-void handle_input(world_t *world, char input) {
-    unsigned int player_row = world->player.position.y;
-    unsigned int player_col = world->player.position.x;
+void entity_store_unlink(entity_store *store, uint32_t id, unsigned int x, unsigned int y) {
+    uint32_t *next = (uint32_t *)store->next.items;
+    uint32_t *link = &store->buckets[entity_store_bucket(store, x, y)];
 
-    if (input == MOVE_UP) {
-        player_row--;
-    } else if (input == MOVE_LEFT) {
-        player_col--;
-    } else if (input == MOVE_DOWN) {
-        player_row++;
-    } else if (input == MOVE_RIGHT) {
-        player_col++;
+    while (*link != id) {
+        link = &next[*link];
     }
+    *link = next[id];
+}
 
-    tile_kind *tile = NULL;
-    unsigned int index = player_row * world->width + player_col;
-    ds_dynamic_array_get_ref(&world->tiles, index, (void **)&tile);
+// Rebuild the buckets so that there are at least as many as entities
+void entity_store_rehash(entity_store *store, unsigned int bucket_count) {
+    DS_FREE(NULL, store->buckets);
+    store->buckets = DS_MALLOC(NULL, bucket_count * sizeof(uint32_t));
+    if (store->buckets == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(store->buckets, 0xff, bucket_count * sizeof(uint32_t));
+    store->bucket_count = bucket_count;
 
-    if (*tile == DOOR_CH && world->inventory.keys > 0) {
-        world->inventory.keys -= 1;
-        *tile = FLOOR_CH;
+    for (unsigned int i = 0; i < store->count; i++) {
+        entity_store_link(store, store->id[i], store->x[i], store->y[i]);
     }
+}
 
-    if (tile_kind_is_impassible(*tile) == 0) {
-        world->player.position.y = player_row;
-        world->player.position.x = player_col;
+void *entity_store_grow(void *items, unsigned int item_size,
+                        unsigned int old_capacity, unsigned int new_capacity) {
+    (void)old_capacity;
+    void *grown = DS_REALLOC(NULL, items, old_capacity * item_size,
+                             new_capacity * item_size);
+    if (grown == NULL) {
+        DS_PANIC("buy more ram");
+    }
+
+    return grown;
+}
+
+// Make room for at least capacity entities
+void entity_store_reserve(entity_store *store, unsigned int capacity) {
+    if (capacity <= store->capacity) {
+        return;
     }
 
-    if (*tile == KEY_CH) {
-        world->inventory.keys += 1;
-        *tile = FLOOR_CH;
-    } else if (*tile == GOLD_CH) {
-        world->inventory.gold += 1;
-        *tile = FLOOR_CH;
+    unsigned int old = store->capacity;
+    store->x = entity_store_grow(store->x, sizeof(*store->x), old, capacity);
+    store->y = entity_store_grow(store->y, sizeof(*store->y), old, capacity);
+    store->symbol = entity_store_grow(store->symbol, sizeof(*store->symbol), old, capacity);
+    store->hp = entity_store_grow(store->hp, sizeof(*store->hp), old, capacity);
+    store->speed = entity_store_grow(store->speed, sizeof(*store->speed), old, capacity);
+    store->ai_state = entity_store_grow(store->ai_state, sizeof(*store->ai_state), old, capacity);
+    store->path = entity_store_grow(store->path, sizeof(*store->path), old, capacity);
+    store->id = entity_store_grow(store->id, sizeof(*store->id), old, capacity);
+    store->capacity = capacity;
+
+    unsigned int bucket_count = store->bucket_count > 0 ? store->bucket_count
+                                                        : ENTITY_MIN_BUCKETS;
+    while (bucket_count < capacity) {
+        bucket_count *= 2;
+    }
+    if (bucket_count != store->bucket_count) {
+        entity_store_rehash(store, bucket_count);
     }
 }
 
-void world_print(world_t *world) {
-    for (unsigned int index = 0; index < world->tiles.count; index++) {
-        tile_kind kind;
-        ds_dynamic_array_get(&world->tiles, index, &kind);
+// Add an entity with the default stats of an enemy
+//
+// Returns the id of the entity.
+uint32_t entity_store_add(entity_store *store, unsigned int x, unsigned int y,
+                          char symbol) {
+    if (store->count == store->capacity) {
+        entity_store_reserve(store, store->capacity > 0 ? store->capacity * 2 : 16);
+    }
 
-        unsigned int row = index / world->width;
-        unsigned int col = index % world->width;
+    uint32_t id = store->index.count;
+    if (store->free_ids.count > 0) {
+        const void *free_id = NULL;
+        ds_dynamic_array_pop(&store->free_ids, &free_id);
+        id = *(const uint32_t *)free_id;
+    } else if (ds_dynamic_array_append(&store->index, &id) != 0 ||
+               ds_dynamic_array_append(&store->next, &id) != 0 ||
+               ds_dynamic_array_append(&store->generation, &(uint32_t){0}) != 0) {
+        DS_PANIC("buy more ram");
+    }
 
-        if (row >= 1 && col == 0) {
-            printf("\n");
-        }
+    unsigned int i = store->count++;
+    store->x[i] = x;
+    store->y[i] = y;
+    store->symbol[i] = symbol;
+    store->hp[i] = ENEMY_HP;
+    store->speed[i] = ENEMY_SPEED;
+    store->ai_state[i] = ENTITY_AI_CHASE;
+    store->path[i] = -1;
+    store->id[i] = id;
+    ((uint32_t *)store->index.items)[id] = i;
+    entity_store_link(store, id, x, y);
 
-        if (row == world->player.position.y && col == world->player.position.x) {
-            entity_print(world->player);
-        } else {
-            int show_tile = 1;
-
-            for (unsigned int j = 0; j < world->enemies.count; j++) {
-                entity e;
-                ds_dynamic_array_get(&world->enemies, j, &e);
-                if (row == e.position.y && col == e.position.x) {
-                    entity_print(e);
-                    show_tile = 0;
-                }
-            }
+    return id;
+}
 
-            if (show_tile) {
-                tile_kind_print(kind);
-            }
-        }
+// Get the index of an entity in the arrays of the store
+//
+// Returns the index, or ENTITY_NONE if there is no entity with this id.
+uint32_t entity_store_index(entity_store *store, uint32_t id) {
+    if (id >= store->index.count) {
+        return ENTITY_NONE;
+    }
+
+    return ((uint32_t *)store->index.items)[id];
+}
+
+// Get the generation of an id, which changes every time the id is freed, so
+// that references to a removed entity are not taken for its successor
+uint32_t entity_store_generation(entity_store *store, uint32_t id) {
+    return ((uint32_t *)store->generation.items)[id];
+}
+
+// Remove an entity by moving the last entity into its place
+//
+// Returns 0 if the entity was removed, 1 if there is no entity with this id.
+int entity_store_remove(entity_store *store, uint32_t id) {
+    uint32_t i = entity_store_index(store, id);
+    if (i == ENTITY_NONE) {
+        return 1;
     }
 
-    printf("\n");
+    entity_store_unlink(store, id, store->x[i], store->y[i]);
 
-    inventory_print(world->inventory);
+    unsigned int last = --store->count;
+    if (i != last) {
+        store->x[i] = store->x[last];
+        store->y[i] = store->y[last];
+        store->symbol[i] = store->symbol[last];
+        store->hp[i] = store->hp[last];
+        store->speed[i] = store->speed[last];
+        store->ai_state[i] = store->ai_state[last];
+        store->path[i] = store->path[last];
+        store->id[i] = store->id[last];
+        ((uint32_t *)store->index.items)[store->id[i]] = i;
+    }
+
+    ((uint32_t *)store->index.items)[id] = ENTITY_NONE;
+    ((uint32_t *)store->generation.items)[id]++;
+    if (ds_dynamic_array_append(&store->free_ids, &id) != 0) {
+        DS_PANIC("buy more ram");
+    }
 
-    printf("\n");
+    return 0;
 }
 
-void world_parse(char *buffer, unsigned int length, world_t *world) {
-    memset(&world->inventory, 0, sizeof(inventory));
-    ds_dynamic_array_init(&world->tiles, sizeof(tile_kind));
-    ds_dynamic_array_init(&world->enemies, sizeof(entity));
+// Move the entity at an index to a new tile
+void entity_store_move(entity_store *store, unsigned int i, unsigned int x,
+                       unsigned int y) {
+    if (entity_store_bucket(store, x, y) !=
+        entity_store_bucket(store, store->x[i], store->y[i])) {
+        entity_store_unlink(store, store->id[i], store->x[i], store->y[i]);
+        entity_store_link(store, store->id[i], x, y);
+    }
+
+    store->x[i] = x;
+    store->y[i] = y;
+}
 
-    ds_string_slice buffer_slice;
-    ds_string_slice_init(&buffer_slice, buffer, length);
+// Find the entity standing on a tile
+//
+// Returns the index of the entity, or ENTITY_NONE if the tile is empty.
+uint32_t entity_store_at(entity_store *store, unsigned int x, unsigned int y) {
+    if (store->bucket_count == 0) {
+        return ENTITY_NONE;
+    }
 
-    ds_string_slice line_slice;
-    unsigned int row = 0;
-    while (ds_string_slice_tokenize(&buffer_slice, '\n', &line_slice) == 0) {
-        char *line;
-        if (ds_string_slice_to_owned(&line_slice, &line) != 0) {
-            DS_PANIC("buy more ram");
+    const uint32_t *next = (const uint32_t *)store->next.items;
+    const uint32_t *index = (const uint32_t *)store->index.items;
+    for (uint32_t id = store->buckets[entity_store_bucket(store, x, y)];
+         id != ENTITY_NONE; id = next[id]) {
+        uint32_t i = index[id];
+        if (store->x[i] == x && store->y[i] == y) {
+            return i;
         }
+    }
 
-        unsigned int line_length = strlen(line);
-        for (unsigned int col = 0; col < line_length; col++) {
-            tile_kind kind;
+    return ENTITY_NONE;
+}
 
-            if (line[col] == PLAYER_CH) {
-                world->player.position.y = row;
-                world->player.position.x = col;
-                world->player.symbol = PLAYER_CH;
-                kind = FLOOR_CH;
-            } else if (isalpha(line[col])) {
-                entity e = { .position = { .x = col, .y = row }, .symbol = line[col] };
-                if (ds_dynamic_array_append(&world->enemies, &e) != 0) {
-                    DS_PANIC("buy more ram");
-                }
-                kind = FLOOR_CH;
-            } else {
-                kind = line[col];
-            }
+// Find the entities inside a rectangle, including its edges
+//
+// Appends the index of every entity found to indices (an array of uint32_t).
+// Returns 0 on success, 1 if the array could not grow.
+int entity_store_query(entity_store *store, unsigned int x0, unsigned int y0,
+                       unsigned int x1, unsigned int y1, ds_dynamic_array *indices) {
+    if (store->bucket_count == 0 || x0 > x1 || y0 > y1) {
+        return 0;
+    }
 
-            if (ds_dynamic_array_append(&world->tiles, &kind) != 0) {
-                DS_PANIC("buy more ram");
+    const uint32_t *next = (const uint32_t *)store->next.items;
+    const uint32_t *index = (const uint32_t *)store->index.items;
+    for (unsigned int cy = y0 >> ENTITY_CELL_SHIFT; cy <= y1 >> ENTITY_CELL_SHIFT; cy++) {
+        for (unsigned int cx = x0 >> ENTITY_CELL_SHIFT; cx <= x1 >> ENTITY_CELL_SHIFT; cx++) {
+            unsigned int bucket = entity_store_bucket(store, cx << ENTITY_CELL_SHIFT,
+                                                      cy << ENTITY_CELL_SHIFT);
+            for (uint32_t id = store->buckets[bucket]; id != ENTITY_NONE; id = next[id]) {
+                uint32_t i = index[id];
+                unsigned int x = store->x[i];
+                unsigned int y = store->y[i];
+
+                // Other cells can share the bucket, only report the entities
+                // of this cell so that none is reported twice
+                if ((x >> ENTITY_CELL_SHIFT) == cx && (y >> ENTITY_CELL_SHIFT) == cy &&
+                    x >= x0 && x <= x1 && y >= y0 && y <= y1 &&
+                    ds_dynamic_array_append(indices, &i) != 0) {
+                    return 1;
+                }
             }
         }
+    }
 
-        world->width = line_length;
-        row++;
+    return 0;
+}
 
-        free(line);
-    }
+// Get a copy of the entity at an index, for printing
+entity entity_store_get(entity_store *store, unsigned int i) {
+    entity e = { .position = { .x = store->x[i], .y = store->y[i] },
+                 .symbol = store->symbol[i] };
+    return e;
+}
 
-    world->height = row;
+void entity_store_free(entity_store *store) {
+    DS_FREE(NULL, store->x);
+    DS_FREE(NULL, store->y);
+    DS_FREE(NULL, store->symbol);
+    DS_FREE(NULL, store->hp);
+    DS_FREE(NULL, store->speed);
+    DS_FREE(NULL, store->ai_state);
+    DS_FREE(NULL, store->path);
+    DS_FREE(NULL, store->id);
+    DS_FREE(NULL, store->buckets);
+    ds_dynamic_array_free(&store->index);
+    ds_dynamic_array_free(&store->free_ids);
+    ds_dynamic_array_free(&store->generation);
+    ds_dynamic_array_free(&store->next);
+    memset(store, 0, sizeof(entity_store));
 }
 
-typedef struct astar_node {
-    uvec2 p;
-    int f;
-} astar_node;
+void inventory_print(ds_string_builder *sb, inventory v) {
+    ds_sb_append_literal(sb, GREEN_COL "Inventory:\n" RESET_COL);
+    ds_sb_append_literal(sb, KEY_COL "- keys: ");
+    ds_string_builder_appendu(sb, v.keys);
+    ds_sb_append_literal(sb, "\n" RESET_COL);
+    ds_sb_append_literal(sb, GOLD_COL "- gold: ");
+    ds_string_builder_appendu(sb, v.gold);
+    ds_sb_append_literal(sb, "\n" RESET_COL);
+}
 
-int astar_node_compare_min(const void *a, const void *b) {
-    return ((astar_node *)b)->f - ((astar_node *)a)->f;
+// TILE BITSETS
+//
+// A bitset over a grid that only allocates the 64x64 blocks in which a bit
+// was set, one word per row of a block. Memory use depends on the part of
+// the grid that is used, not on its size: the table of blocks takes one
+// pointer per 4096 bits.
+#define TILE_BITSET_BLOCK 64
+
+typedef struct tile_bitset {
+    uint64_t **blocks; // NULL until a bit of the block is set
+    unsigned int blocks_x;
+    unsigned int block_count;
+    unsigned int allocated;
+} tile_bitset;
+
+void tile_bitset_init(tile_bitset *bits, unsigned int width, unsigned int height) {
+    bits->blocks_x = (unsigned int)(((uint64_t)width + TILE_BITSET_BLOCK - 1) / TILE_BITSET_BLOCK);
+    bits->block_count = bits->blocks_x * (unsigned int)(((uint64_t)height + TILE_BITSET_BLOCK - 1) /
+                                                        TILE_BITSET_BLOCK);
+    bits->allocated = 0;
+    bits->blocks = DS_MALLOC(NULL, (bits->block_count > 0 ? bits->block_count : 1) *
+                                       sizeof(uint64_t *));
+    if (bits->blocks == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(bits->blocks, 0, bits->block_count * sizeof(uint64_t *));
 }
 
-int manhattan_distance(uvec2 p1, uvec2 p2) {
-    return abs((int)p1.x - (int)p2.x) + abs((int)p1.y - (int)p2.y);
+static inline uint64_t *tile_bitset_block(const tile_bitset *bits, unsigned int x,
+                                          unsigned int y) {
+    return bits->blocks[(y / TILE_BITSET_BLOCK) * bits->blocks_x + x / TILE_BITSET_BLOCK];
 }
 
-int uvec2_hash(struct world *w, uvec2 p) {
-    return p.y * w->width + p.x;
+static inline int tile_bitset_get(const tile_bitset *bits, unsigned int x, unsigned int y) {
+    const uint64_t *block = tile_bitset_block(bits, x, y);
+    return block != NULL && (block[y % TILE_BITSET_BLOCK] >> (x % TILE_BITSET_BLOCK)) & 1;
 }
 
-int uvec2_equals(uvec2 p1, uvec2 p2) {
-    return p1.x == p2.x && p1.y == p2.y;
+void tile_bitset_set(tile_bitset *bits, unsigned int x, unsigned int y) {
+    uint64_t **block = &bits->blocks[(y / TILE_BITSET_BLOCK) * bits->blocks_x +
+                                     x / TILE_BITSET_BLOCK];
+    if (*block == NULL) {
+        *block = DS_MALLOC(NULL, TILE_BITSET_BLOCK * sizeof(uint64_t));
+        if (*block == NULL) {
+            DS_PANIC("buy more ram");
+        }
+        memset(*block, 0, TILE_BITSET_BLOCK * sizeof(uint64_t));
+        bits->allocated++;
+    }
+    (*block)[y % TILE_BITSET_BLOCK] |= 1ULL << (x % TILE_BITSET_BLOCK);
 }
 
-int reconstruct_path(struct world *w, int *came_from, uvec2 current,
-                     ds_dynamic_array *p) {
-    ds_dynamic_array_append(p, &current);
-    int current_index = uvec2_hash(w, current);
+void tile_bitset_clear(tile_bitset *bits, unsigned int x, unsigned int y) {
+    uint64_t *block = tile_bitset_block(bits, x, y);
+    if (block != NULL) {
+        block[y % TILE_BITSET_BLOCK] &= ~(1ULL << (x % TILE_BITSET_BLOCK));
+    }
+}
 
-    while (came_from[current_index] != -1) {
-        current_index = came_from[current_index];
-        uvec2 current = {current_index % w->width, current_index / w->width};
-        ds_dynamic_array_append(p, &current);
+// Clear every bit, keeping the blocks for reuse
+void tile_bitset_clear_all(tile_bitset *bits) {
+    for (unsigned int i = 0; i < bits->block_count; i++) {
+        if (bits->blocks[i] != NULL) {
+            memset(bits->blocks[i], 0, TILE_BITSET_BLOCK * sizeof(uint64_t));
+        }
     }
+}
 
-    return 0;
+void tile_bitset_free(tile_bitset *bits) {
+    for (unsigned int i = 0; i < bits->block_count && bits->blocks != NULL; i++) {
+        DS_FREE(NULL, bits->blocks[i]);
+    }
+    DS_FREE(NULL, bits->blocks);
+    memset(bits, 0, sizeof(tile_bitset));
 }
 
-const uvec2 directions[] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
-const int num_directions = sizeof(directions) / sizeof(directions[0]);
+// CHANGE JOURNAL
+//
+// Every change to the world during a tick is recorded in the journal: the
+// tiles that were modified and the entities that moved. The journal also
+// summarizes the tick as the rectangle that covers all the changes and as a
+// bitset of the 8x8 tile cells that were touched. At the end of the tick
+// world_journal_commit hands the journal to every subscriber and clears it,
+// so the renderer, caches and savers only have to redo the work for what
+// actually changed.
+#define WORLD_CHANGE_TILE 0
+#define WORLD_CHANGE_ENTITY 1
+#define WORLD_JOURNAL_CELL_SHIFT 3
+#define WORLD_JOURNAL_PLAYER UINT32_MAX // the entity id recorded for the player
 
-int a_star(world_t *w, uvec2 start, uvec2 end, ds_dynamic_array /* uvec2 */ *p) {
-    int result = 0;
-    unsigned int num_nodes = w->width * w->height;
+typedef struct world_change {
+    uint8_t kind;
+    tile_kind tile_from; // the old and new tile, for tile changes
+    tile_kind tile_to;
+    uint32_t id;   // the entity that moved, for entity changes
+    uint32_t from; // tile index before and after the change, the same for
+    uint32_t to;   // tile changes
+} world_change;
 
-    // The set of discovered nodes that may need to be (re-)expanded.
-    // Initially, only the start node is known.
-    // This is usually implemented as a min-heap or priority queue rather than a
-    // hash-set.
-    ds_priority_queue open_set;
-    ds_priority_queue_init(&open_set, astar_node_compare_min, sizeof(astar_node));
+struct world;
+struct world_journal;
+typedef void (*world_journal_callback)(struct world *world,
+                                       const struct world_journal *journal,
+                                       void *user);
 
-    struct astar_node start_node = { start, manhattan_distance(start, end) };
-    ds_priority_queue_insert(&open_set, &start_node);
+typedef struct world_journal_subscriber {
+    world_journal_callback callback;
+    void *user;
+} world_journal_subscriber;
+
+typedef struct world_journal {
+    uint64_t tick;
+    ds_dynamic_array /* world_change */ changes;
+    unsigned int x0; // rectangle that covers the changes, inclusive, valid
+    unsigned int y0; // if marked is set
+    unsigned int x1;
+    unsigned int y1;
+    int marked;        // set once a tile was marked during this tick
+    tile_bitset cells; // one bit per cell that changed, allocated on first use
+    ds_dynamic_array /* world_journal_subscriber */ subscribers;
+} world_journal;
 
-    // For node n, cameFrom[n] is the node immediately preceding it on the
-    // cheapest path from the start to n currently known.
-    int *came_from = (int *)malloc(num_nodes * sizeof(int));
-    for (int i = 0; i < num_nodes; i++) {
-        came_from[i] = -1;
+// ACTOR SCHEDULER
+//
+// Game time is counted in units, SCHEDULER_TURN units to a turn of the player.
+// Every actor gains its speed in energy each turn and an action costs
+// ENTITY_ACTION_COST energy, so an actor with twice the normal speed acts
+// twice per turn. Instead of adding energy every unit, the scheduler keeps for
+// each actor the time at which it has enough energy for its next action.
+//
+// The pending events are kept in a hierarchical timing wheel: 4 levels of 64
+// slots, where a slot of level l covers 64^l units. An event goes into the
+// lowest level whose slots cover its time from the current block on, and is
+// moved down a level when the time reaches the start of its slot, so both
+// scheduling and extracting an event are O(1). Events that are further away
+// than the wheel covers wait in an overflow list. The events live in a pool
+// and are chained by index.
+#define SCHEDULER_TURN 12
+#define SCHEDULER_WHEEL_BITS 6
+#define SCHEDULER_WHEEL_SLOTS (1 << SCHEDULER_WHEEL_BITS)
+#define SCHEDULER_WHEEL_LEVELS 4
+#define SCHEDULER_NONE UINT32_MAX
+#define SCHEDULE_ENEMY 0 // an enemy acts, the id is the entity id and the
+                         // generation its generation in the entity store
+
+typedef struct scheduled_event {
+    uint64_t time;
+    uint32_t id;
+    uint32_t generation; // of the id when scheduled, stale if it changed since
+    uint16_t kind;
+    uint32_t next; // next event in the same slot or in the free list
+} scheduled_event;
+
+typedef struct actor_scheduler {
+    uint64_t now;
+    ds_dynamic_array /* scheduled_event */ events;
+    uint32_t free_event; // first unused event in the pool, or SCHEDULER_NONE
+    uint32_t slots[SCHEDULER_WHEEL_LEVELS][SCHEDULER_WHEEL_SLOTS];
+    uint32_t overflow;
+    unsigned int count;
+} actor_scheduler;
+
+void actor_scheduler_init(actor_scheduler *scheduler) {
+    memset(scheduler, 0, sizeof(actor_scheduler));
+    ds_dynamic_array_init(&scheduler->events, sizeof(scheduled_event));
+    memset(scheduler->slots, 0xff, sizeof(scheduler->slots));
+    scheduler->free_event = SCHEDULER_NONE;
+    scheduler->overflow = SCHEDULER_NONE;
+}
+
+// Put the event in the slot that covers its time
+void actor_scheduler_link(actor_scheduler *scheduler, uint32_t event) {
+    scheduled_event *events = (scheduled_event *)scheduler->events.items;
+    uint64_t time = events[event].time;
+
+    uint32_t *head = &scheduler->overflow;
+    for (unsigned int level = 0; level < SCHEDULER_WHEEL_LEVELS; level++) {
+        unsigned int shift = SCHEDULER_WHEEL_BITS * (level + 1);
+        if ((time >> shift) == (scheduler->now >> shift)) {
+            unsigned int slot = (time >> (SCHEDULER_WHEEL_BITS * level)) & (SCHEDULER_WHEEL_SLOTS - 1);
+            head = &scheduler->slots[level][slot];
+            break;
+        }
     }
 
-    // For node n, gScore[n] is the cost of the cheapest path from start to n
-    // currently known.
-    int *g_score = (int *)malloc(num_nodes * sizeof(int));
-    for (int i = 0; i < num_nodes; i++) {
-        g_score[i] = INT_MAX;
+    events[event].next = *head;
+    *head = event;
+}
+
+// Schedule an event at the given time, or on the next unit if the time has
+// already come
+void actor_scheduler_schedule(actor_scheduler *scheduler, uint64_t time, uint16_t kind,
+                              uint32_t id, uint32_t generation) {
+    uint32_t event = scheduler->free_event;
+    if (event != SCHEDULER_NONE) {
+        scheduler->free_event = ((scheduled_event *)scheduler->events.items)[event].next;
+    } else {
+        scheduled_event empty = {0};
+        event = scheduler->events.count;
+        if (ds_dynamic_array_append(&scheduler->events, &empty) != 0) {
+            DS_PANIC("buy more ram");
+        }
     }
-    g_score[uvec2_hash(w, start)] = 0;
 
-    // For node n, fScore[n] := gScore[n] + h(n). fScore[n] represents our
-    // current best guess as to how cheap a path could be from start to finish
-    // if it goes through n.
-    int *f_score = (int *)malloc(num_nodes * sizeof(int));
-    for (int i = 0; i < num_nodes; i++) {
-        f_score[i] = INT_MAX;
+    scheduled_event *e = (scheduled_event *)scheduler->events.items + event;
+    e->time = time > scheduler->now ? time : scheduler->now + 1;
+    e->id = id;
+    e->generation = generation;
+    e->kind = kind;
+    actor_scheduler_link(scheduler, event);
+    scheduler->count++;
+}
+
+// Move the events of a slot to the slots that cover them from the current time
+void actor_scheduler_cascade(actor_scheduler *scheduler, uint32_t *head) {
+    uint32_t event = *head;
+    *head = SCHEDULER_NONE;
+
+    while (event != SCHEDULER_NONE) {
+        uint32_t next = ((scheduled_event *)scheduler->events.items)[event].next;
+        actor_scheduler_link(scheduler, event);
+        event = next;
     }
-    f_score[uvec2_hash(w, start)] = manhattan_distance(start, end);
+}
 
-    astar_node current_node = {0};
-    while (ds_priority_queue_empty(&open_set) == 0) {
-        // This operation can occur in O(Log(N)) time if openSet is a min-heap
-        // or a priority queue
-        ds_priority_queue_pull(&open_set, (void *)&current_node);
-        int current_index = uvec2_hash(w, current_node.p);
+// Advance the time by one unit and append the events that are due to the
+// array. The events go back to the pool, so the array holds copies.
+void actor_scheduler_advance(actor_scheduler *scheduler,
+                             ds_dynamic_array /* scheduled_event */ *due) {
+    uint64_t now = ++scheduler->now;
 
-        uvec2 current = current_node.p;
+    if ((now & ((1ULL << (SCHEDULER_WHEEL_BITS * SCHEDULER_WHEEL_LEVELS)) - 1)) == 0) {
+        actor_scheduler_cascade(scheduler, &scheduler->overflow);
+    }
+    for (unsigned int level = SCHEDULER_WHEEL_LEVELS - 1; level >= 1; level--) {
+        unsigned int shift = SCHEDULER_WHEEL_BITS * level;
+        if ((now & ((1ULL << shift) - 1)) == 0) {
+            unsigned int slot = (now >> shift) & (SCHEDULER_WHEEL_SLOTS - 1);
+            actor_scheduler_cascade(scheduler, &scheduler->slots[level][slot]);
+        }
+    }
 
-        if (uvec2_equals(current_node.p, end)) {
-            reconstruct_path(w, came_from, current_node.p, p);
-            return_defer(1);
+    uint32_t *head = &scheduler->slots[0][now & (SCHEDULER_WHEEL_SLOTS - 1)];
+    uint32_t event = *head;
+    *head = SCHEDULER_NONE;
+
+    while (event != SCHEDULER_NONE) {
+        scheduled_event *e = (scheduled_event *)scheduler->events.items + event;
+        uint32_t next = e->next;
+        if (ds_dynamic_array_append(due, e) != 0) {
+            DS_PANIC("buy more ram");
         }
 
-        for (int i = 0; i < num_directions; i++) {
-            uvec2 neighbor = {current.x + directions[i].x, current.y + directions[i].y};
-            int neighbor_index = uvec2_hash(w, neighbor);
+        e->next = scheduler->free_event;
+        scheduler->free_event = event;
+        scheduler->count--;
+        event = next;
+    }
+}
 
-            tile_kind tile;
-            ds_dynamic_array_get(&w->tiles, neighbor_index, &tile);
+void actor_scheduler_free(actor_scheduler *scheduler) {
+    ds_dynamic_array_free(&scheduler->events);
+}
 
-            if (neighbor.x < 0 || neighbor.x >= w->width || neighbor.y < 0 ||
-                neighbor.y >= w->height || tile_kind_is_impassible(tile)) {
-                continue;
-            }
+// AI LEVEL OF DETAIL
+//
+// The enemies are put into tiers by their distance to the player each time
+// they act. Near enemies find their path with a_star. Enemies further away
+// take a greedy step towards the player instead, which is much cheaper but
+// can get stuck behind walls, and far enemies also act less often. An enemy
+// moves back to a closer tier as soon as the player comes closer. The number
+// of actions and the time spent planning them are counted per tier, so the
+// radii can be tuned against a budget.
+#define ENEMY_LOD_NEAR 0
+#define ENEMY_LOD_MID 1
+#define ENEMY_LOD_FAR 2
+#define ENEMY_LOD_TIERS 3
+#define ENEMY_LOD_NEAR_RADIUS 32 // Manhattan distance to the player
+#define ENEMY_LOD_MID_RADIUS 128
+#define ENEMY_LOD_FAR_INTERVAL 4 // far enemies act once every 4 actions
 
-            // d(current,neighbor) is the weight of the edge from current to
-            // neighbor tentative_gScore is the distance from start to the
-            // neighbor through current
-            int tentative_g_score = g_score[current_index] + 1;
-            if (tentative_g_score < g_score[neighbor_index]) {
-                // This path to neighbor is better than any previous one.
-                came_from[neighbor_index] = current_index;
-                g_score[neighbor_index] = tentative_g_score;
-                f_score[neighbor_index] =
-                    tentative_g_score + manhattan_distance(neighbor, end);
+typedef struct enemy_lod_stats {
+    uint64_t actions[ENEMY_LOD_TIERS];
+    uint64_t nanoseconds[ENEMY_LOD_TIERS]; // spent planning, summed over threads
+} enemy_lod_stats;
 
-                int found = 0;
-                for (unsigned int j = 0; j < open_set.items.count; j++) {
-                    astar_node node;
-                    ds_dynamic_array_get(&open_set.items, j, &node);
+#define WORLD_FOV_RADIUS 40
 
-                    if (uvec2_equals(node.p, neighbor)) {
-                        found = 1;
-                        break;
-                    }
-                }
+typedef struct world_fov {
+    tile_bitset visible;  // one bit per tile, set if the player sees it
+    tile_bitset explored; // one bit per tile, set if the player ever saw it
+    uvec2 origin;       // where the field of view was computed from
+    unsigned int x0;    // square around the origin that can have visible
+    unsigned int y0;    // tiles, inclusive, valid if valid is set
+    unsigned int x1;
+    unsigned int y1;
+    int valid;
+    unsigned int computations;
+} world_fov;
 
-                if (found == 0) {
-                    astar_node neighbor_node = { neighbor, f_score[neighbor_index] };
-                    ds_priority_queue_insert(&open_set, &neighbor_node);
-                }
-            }
+typedef struct world {
+    entity player;
+    inventory inventory;
+    unsigned int width;
+    unsigned int height;
+    ds_dynamic_array /* tile_kind */ tiles;
+    entity_store enemies;
+    uint64_t *passable; // one bit per tile, set if the tile can be walked on
+    uint32_t *regions;  // connected region of each tile, NULL if not loaded
+    ds_io_mapping map;  // backs tiles, passable and regions for .rmap worlds
+    struct world_chunks *chunks; // streams the tiles from disk, NULL if the
+                                 // tiles are in memory
+    struct job_system *jobs; // runs the per-tick systems, NULL to run them on
+                             // the calling thread
+    world_journal journal;
+    actor_scheduler scheduler;
+    ds_dynamic_array /* scheduled_event */ due; // events of the current unit
+    ds_dynamic_array /* uint32_t */ actors;     // enemies that act on it
+    enemy_lod_stats lod;
+    world_fov fov;
+} world_t;
+
+// CHUNKED WORLDS
+//
+// A chunked world keeps its tiles on disk in square chunks and only holds a
+// bounded number of them in memory. A chunk is read the first time one of its
+// tiles is used, the least recently used chunk is evicted when the cache is
+// full, and a chunk that was modified is written back to the file before it
+// is evicted. Memory use depends on the cache size, not on the map size.
+//
+// A chunk is 64 tiles wide, so one word of the passability bitmap covers one
+// row of a chunk.
+#define WORLD_CHUNK_SIZE 64
+#define WORLD_CHUNK_TILES (WORLD_CHUNK_SIZE * WORLD_CHUNK_SIZE)
+#define WORLD_CHUNK_CACHE 64
+#define WORLD_STREAM_RADIUS 1 // chunks kept loaded around the player
+
+typedef struct world_chunk {
+    tile_kind tiles[WORLD_CHUNK_TILES];
+    uint64_t passable[WORLD_CHUNK_SIZE];
+    unsigned int id;
+    int dirty;
+    ds_intrusive_list_node lru;
+} world_chunk;
+
+typedef struct world_chunks {
+    int fd;
+    int writable; // the file is opened read only until a chunk is written back
+    char *path;
+    unsigned int chunks_x;
+    unsigned int chunks_y;
+    uint64_t *offsets; // file offset of every chunk
+    int32_t *slots;    // cache slot of every chunk, -1 if it is not loaded
+    world_chunk *cache;
+    unsigned int capacity;
+    unsigned int used;
+    world_chunk *last; // the chunk of the previous lookup
+    ds_intrusive_list lru; // most recently used first
+    unsigned int loads;
+    unsigned int evictions;
+    unsigned int writes;
+} world_chunks;
+
+void world_chunk_write(world_chunks *chunks, world_chunk *chunk) {
+    if (!chunks->writable) {
+        int fd = open(chunks->path, O_RDWR);
+        if (fd < 0) {
+            DS_PANIC("failed to open %s for writing", chunks->path);
         }
+        close(chunks->fd);
+        chunks->fd = fd;
+        chunks->writable = 1;
     }
 
-defer:
-    ds_priority_queue_free(&open_set);
-    free(came_from);
-    free(g_score);
-    free(f_score);
-
-    return result;
+    if (pwrite(chunks->fd, chunk->tiles, WORLD_CHUNK_TILES,
+               chunks->offsets[chunk->id]) != WORLD_CHUNK_TILES) {
+        DS_PANIC("failed to write chunk %u", chunk->id);
+    }
+    chunk->dirty = 0;
+    chunks->writes++;
 }
 
-typedef struct input {
-    char last_key;
-} input_t;
+// Read a chunk into a free cache slot, or into the slot of the least
+// recently used chunk
+world_chunk *world_chunk_load(world_chunks *chunks, unsigned int id) {
+    world_chunk *chunk = NULL;
 
-void *input_thread(void *arg) {
-    input_t *input = (input_t *)arg;
+    if (chunks->used < chunks->capacity) {
+        chunk = &chunks->cache[chunks->used++];
+    } else {
+        chunk = ds_container_of(ds_intrusive_list_pop_back(&chunks->lru),
+                                world_chunk, lru);
+        if (chunk->dirty) {
+            world_chunk_write(chunks, chunk);
+        }
+        chunks->slots[chunk->id] = -1;
+        chunks->evictions++;
+    }
 
-    for (;;) {
-        input->last_key = getchar();
+    if (pread(chunks->fd, chunk->tiles, WORLD_CHUNK_TILES, chunks->offsets[id]) !=
+        WORLD_CHUNK_TILES) {
+        DS_PANIC("failed to read chunk %u", id);
+    }
 
-        if (input->last_key == QUIT_KEY) {
-            break;
+    for (unsigned int row = 0; row < WORLD_CHUNK_SIZE; row++) {
+        const tile_kind *tiles = chunk->tiles + row * WORLD_CHUNK_SIZE;
+        uint64_t bits = 0;
+        for (unsigned int col = 0; col < WORLD_CHUNK_SIZE; col++) {
+            bits |= (uint64_t)(tile_kind_is_impassible(tiles[col]) == 0) << col;
         }
+        chunk->passable[row] = bits;
     }
 
-    return NULL;
+    chunk->id = id;
+    chunk->dirty = 0;
+    chunks->slots[id] = chunk - chunks->cache;
+    chunks->loads++;
+
+    return chunk;
 }
 
-int main(void) {
-    world_t world;
-    char *buffer = NULL;
+// Get the chunk that holds a tile, loading it if needed
+world_chunk *world_chunk_get(world_chunks *chunks, unsigned int x, unsigned int y) {
+    unsigned int id = (y / WORLD_CHUNK_SIZE) * chunks->chunks_x + x / WORLD_CHUNK_SIZE;
+    if (chunks->last != NULL && chunks->last->id == id) {
+        return chunks->last;
+    }
 
-    int length = ds_io_read_file(MAP_FILE, &buffer);
-    if (length < 0) {
-        DS_PANIC("failed to read the map!");
+    world_chunk *chunk = NULL;
+    if (chunks->slots[id] >= 0) {
+        chunk = &chunks->cache[chunks->slots[id]];
+        ds_intrusive_list_remove(&chunk->lru);
+    } else {
+        chunk = world_chunk_load(chunks, id);
     }
-    world_parse(buffer, length, &world);
+    ds_intrusive_list_push_front(&chunks->lru, &chunk->lru);
+    chunks->last = chunk;
 
-    input_t input = { .last_key = 0 };
-    pthread_t input_thread_id;
-    pthread_create(&input_thread_id, NULL, input_thread, &input);
+    return chunk;
+}
 
-    while (1) {
-        // update
-        handle_input(&world, input.last_key);
-        if (input.last_key == QUIT_KEY) {
-            break;
+// Write back the modified chunks, close the file and free the cache
+void world_chunks_free(world_chunks *chunks) {
+    for (unsigned int i = 0; i < chunks->used; i++) {
+        if (chunks->cache[i].dirty) {
+            world_chunk_write(chunks, &chunks->cache[i]);
         }
-        if (input.last_key != 0) {
-            for (unsigned int i = 0; i < world.enemies.count; i++) {
-                ds_dynamic_array p;
-                ds_dynamic_array_init(&p, sizeof(uvec2));
+    }
 
-                entity *enemy;
-                ds_dynamic_array_get_ref(&world.enemies, i, (void **)&enemy);
+    close(chunks->fd);
+    DS_FREE(NULL, chunks->path);
+    DS_FREE(NULL, chunks->offsets);
+    DS_FREE(NULL, chunks->slots);
+    DS_FREE(NULL, chunks->cache);
+    DS_FREE(NULL, chunks);
+}
 
-                a_star(&world, enemy->position, world.player.position, &p);
+void world_journal_init(world_journal *journal) {
+    memset(journal, 0, sizeof(world_journal));
+    ds_dynamic_array_init(&journal->changes, sizeof(world_change));
+    ds_dynamic_array_init(&journal->subscribers, sizeof(world_journal_subscriber));
+}
 
-                if (p.count >= 2) {
-                    unsigned int next = p.count - 2;
-                    ds_dynamic_array_get(&p, next, &enemy->position);
-                }
+// Call a function with the journal of every tick, before it is cleared
+void world_journal_subscribe(world_t *world, world_journal_callback callback,
+                             void *user) {
+    world_journal_subscriber subscriber = { .callback = callback, .user = user };
+    if (ds_dynamic_array_append(&world->journal.subscribers, &subscriber) != 0) {
+        DS_PANIC("buy more ram");
+    }
+}
 
-                ds_dynamic_array_free(&p);
-            }
-        }
-        input.last_key = 0;
+void world_journal_mark(world_t *world, unsigned int x, unsigned int y) {
+    world_journal *journal = &world->journal;
 
-        // render
-        system("stty cooked");
-        printf("%s", CLEAR_SCREEN_ANSI);
-        world_print(&world);
-        system("stty raw");
+    if (journal->cells.blocks == NULL) {
+        tile_bitset_init(&journal->cells, (world->width >> WORLD_JOURNAL_CELL_SHIFT) + 1,
+                         (world->height >> WORLD_JOURNAL_CELL_SHIFT) + 1);
+    }
+    tile_bitset_set(&journal->cells, x >> WORLD_JOURNAL_CELL_SHIFT,
+                    y >> WORLD_JOURNAL_CELL_SHIFT);
 
-        usleep(160000);
+    if (!journal->marked) {
+        journal->x0 = journal->x1 = x;
+        journal->y0 = journal->y1 = y;
+        journal->marked = 1;
+    } else {
+        journal->x0 = x < journal->x0 ? x : journal->x0;
+        journal->y0 = y < journal->y0 ? y : journal->y0;
+        journal->x1 = x > journal->x1 ? x : journal->x1;
+        journal->y1 = y > journal->y1 ? y : journal->y1;
     }
+}
 
-    pthread_join(input_thread_id, NULL);
+// Record a change, after the tiles it touches have been marked
+void world_journal_record(world_t *world, world_change change) {
+    if (ds_dynamic_array_append(&world->journal.changes, &change) != 0) {
+        DS_PANIC("buy more ram");
+    }
+}
 
-    world_free(&world);
-    free(buffer);
+// Check if a tile is in one of the cells that changed during this tick
+int world_journal_is_dirty(world_t *world, unsigned int x, unsigned int y) {
+    world_journal *journal = &world->journal;
+    if (journal->changes.count == 0) {
+        return 0;
+    }
+
+    return tile_bitset_get(&journal->cells, x >> WORLD_JOURNAL_CELL_SHIFT,
+                           y >> WORLD_JOURNAL_CELL_SHIFT);
+}
+
+// End the tick: pass the journal to the subscribers and clear it
+void world_journal_commit(world_t *world) {
+    world_journal *journal = &world->journal;
+
+    for (unsigned int i = 0; i < journal->subscribers.count; i++) {
+        world_journal_subscriber *subscriber =
+            (world_journal_subscriber *)journal->subscribers.items + i;
+        subscriber->callback(world, journal, subscriber->user);
+    }
+
+    // Only the bits of the cells that changed are set. Unless they cover
+    // most of the allocated blocks, clear them one by one instead of
+    // clearing the blocks.
+    if (journal->changes.count * 2 > journal->cells.allocated * TILE_BITSET_BLOCK) {
+        tile_bitset_clear_all(&journal->cells);
+    } else {
+        for (unsigned int i = 0; i < journal->changes.count; i++) {
+            world_change *change = (world_change *)journal->changes.items + i;
+            unsigned int indices[2] = { change->from, change->to };
+            for (unsigned int j = 0; j < 2; j++) {
+                unsigned int x = indices[j] % world->width;
+                unsigned int y = indices[j] / world->width;
+                tile_bitset_clear(&journal->cells, x >> WORLD_JOURNAL_CELL_SHIFT,
+                                  y >> WORLD_JOURNAL_CELL_SHIFT);
+            }
+        }
+    }
+
+    journal->changes.count = 0;
+    journal->marked = 0;
+    journal->tick++;
+}
+
+void world_journal_free(world_journal *journal) {
+    ds_dynamic_array_free(&journal->changes);
+    ds_dynamic_array_free(&journal->subscribers);
+    tile_bitset_free(&journal->cells);
+}
+
+// Move an enemy and record the move in the journal
+void world_move_enemy(world_t *world, unsigned int i, unsigned int x, unsigned int y) {
+    entity_store *enemies = &world->enemies;
+    world_change change = { .kind = WORLD_CHANGE_ENTITY,
+                            .id = enemies->id[i],
+                            .from = enemies->y[i] * world->width + enemies->x[i],
+                            .to = y * world->width + x };
+    world_journal_mark(world, enemies->x[i], enemies->y[i]);
+    world_journal_mark(world, x, y);
+    world_journal_record(world, change);
+    entity_store_move(enemies, i, x, y);
+}
+
+void world_free(world_t *world) {
+    if (world->chunks != NULL) {
+        world_chunks_free(world->chunks);
+        world->chunks = NULL;
+    } else if (world->map.data != NULL) {
+        ds_io_unmap_file(&world->map);
+    } else {
+        ds_dynamic_array_free(&world->tiles);
+        DS_FREE(NULL, world->passable);
+        DS_FREE(NULL, world->regions);
+    }
+    entity_store_free(&world->enemies);
+    world_journal_free(&world->journal);
+    actor_scheduler_free(&world->scheduler);
+    tile_bitset_free(&world->fov.visible);
+    tile_bitset_free(&world->fov.explored);
+    ds_dynamic_array_free(&world->due);
+    ds_dynamic_array_free(&world->actors);
+
+    world->passable = NULL;
+    world->regions = NULL;
+}
+
+// The tiles are accessed by index (row * width + column) through these
+// functions, which work for both in memory and chunked worlds
+tile_kind world_get_tile(world_t *world, unsigned int index) {
+    if (world->chunks != NULL) {
+        unsigned int x = index % world->width;
+        unsigned int y = index / world->width;
+        world_chunk *chunk = world_chunk_get(world->chunks, x, y);
+        return chunk->tiles[(y % WORLD_CHUNK_SIZE) * WORLD_CHUNK_SIZE +
+                            x % WORLD_CHUNK_SIZE];
+    }
+
+    return ((tile_kind *)world->tiles.items)[index];
+}
+
+int world_is_passable(world_t *world, unsigned int index) {
+    if (world->chunks != NULL) {
+        unsigned int x = index % world->width;
+        unsigned int y = index / world->width;
+        world_chunk *chunk = world_chunk_get(world->chunks, x, y);
+        return (chunk->passable[y % WORLD_CHUNK_SIZE] >> (x % WORLD_CHUNK_SIZE)) & 1;
+    }
+
+    return (world->passable[index / 64] >> (index % 64)) & 1;
+}
+
+void world_set_tile(world_t *world, unsigned int index, tile_kind kind) {
+    world_change change = { .kind = WORLD_CHANGE_TILE,
+                            .tile_from = world_get_tile(world, index),
+                            .tile_to = kind,
+                            .from = index,
+                            .to = index };
+    world_journal_mark(world, index % world->width, index / world->width);
+    world_journal_record(world, change);
+
+    if (world->chunks != NULL) {
+        unsigned int x = index % world->width;
+        unsigned int y = index / world->width;
+        world_chunk *chunk = world_chunk_get(world->chunks, x, y);
+        uint64_t bit = (uint64_t)1 << (x % WORLD_CHUNK_SIZE);
+
+        chunk->tiles[(y % WORLD_CHUNK_SIZE) * WORLD_CHUNK_SIZE + x % WORLD_CHUNK_SIZE] = kind;
+        if (tile_kind_is_impassible(kind)) {
+            chunk->passable[y % WORLD_CHUNK_SIZE] &= ~bit;
+        } else {
+            chunk->passable[y % WORLD_CHUNK_SIZE] |= bit;
+        }
+        chunk->dirty = 1;
+        return;
+    }
+
+    ((tile_kind *)world->tiles.items)[index] = kind;
+
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    if (tile_kind_is_impassible(kind)) {
+        world->passable[index / 64] &= ~bit;
+    } else {
+        world->passable[index / 64] |= bit;
+    }
+}
+
+void handle_input(world_t *world, char input) {
+    unsigned int player_row = world->player.position.y;
+    unsigned int player_col = world->player.position.x;
+
+    if (input == MOVE_UP) {
+        player_row--;
+    } else if (input == MOVE_LEFT) {
+        player_col--;
+    } else if (input == MOVE_DOWN) {
+        player_row++;
+    } else if (input == MOVE_RIGHT) {
+        player_col++;
+    }
+
+    if (player_row >= world->height || player_col >= world->width) {
+        return;
+    }
+
+    unsigned int index = player_row * world->width + player_col;
+    const tile_props *props = tile_kind_props(world_get_tile(world, index));
+
+    if ((props->flags & TILE_DOOR) && world->inventory.keys > 0) {
+        world->inventory.keys -= 1;
+        world_set_tile(world, index, props->becomes);
+        props = tile_kind_props(props->becomes);
+    }
+
+    if ((props->flags & TILE_SOLID) == 0 &&
+        (player_row != world->player.position.y || player_col != world->player.position.x)) {
+        world_change change = {
+            .kind = WORLD_CHANGE_ENTITY,
+            .id = WORLD_JOURNAL_PLAYER,
+            .from = world->player.position.y * world->width + world->player.position.x,
+            .to = index };
+        world_journal_mark(world, world->player.position.x, world->player.position.y);
+        world_journal_mark(world, player_col, player_row);
+        world_journal_record(world, change);
+
+        world->player.position.y = player_row;
+        world->player.position.x = player_col;
+    }
+
+    if (props->flags & TILE_PICKUP) {
+        *(unsigned int *)((char *)&world->inventory + props->pickup) += 1;
+        world_set_tile(world, index, props->becomes);
+    }
+}
+
+// FIELD OF VIEW
+//
+// The tiles that the player can see are computed with recursive shadowcasting:
+// each of the 8 octants around the player is scanned row by row, and an
+// opaque tile narrows the range of slopes that the rows behind it can still
+// see. The result is kept as two tile bitsets, the tiles that are visible now
+// and the tiles that were ever visible, so a query is a single bit test and
+// only the blocks the player has been near are allocated. The field of view is computed again at the end of a tick in which
+// the player moved or a tile in view became or stopped being opaque, and only
+// the square around the player is cleared.
+static inline int world_is_visible(world_t *world, unsigned int x, unsigned int y) {
+    return tile_bitset_get(&world->fov.visible, x, y);
+}
+
+static inline int world_is_explored(world_t *world, unsigned int x, unsigned int y) {
+    return tile_bitset_get(&world->fov.explored, x, y);
+}
+
+void world_fov_light(world_t *world, int x, int y) {
+    tile_bitset_set(&world->fov.visible, x, y);
+    tile_bitset_set(&world->fov.explored, x, y);
+}
+
+int world_fov_blocks(world_t *world, int x, int y) {
+    if (x < 0 || y < 0 || (unsigned int)x >= world->width || (unsigned int)y >= world->height) {
+        return 1;
+    }
+    tile_kind kind = world_get_tile(world, (unsigned int)y * world->width + (unsigned int)x);
+    return (tile_kind_props(kind)->flags & TILE_OPAQUE) != 0;
+}
+
+// Scan the rows of one octant from the given row on, between the start and
+// end slopes. The octant is mapped to the map by (xx, xy, yx, yy).
+void world_fov_cast(world_t *world, int row, double start, double end, int xx, int xy,
+                    int yx, int yy) {
+    if (start < end) {
+        return;
+    }
+
+    int cx = (int)world->fov.origin.x;
+    int cy = (int)world->fov.origin.y;
+    int radius = WORLD_FOV_RADIUS;
+    double next_start = start;
+
+    for (int j = row; j <= radius; j++) {
+        int blocked = 0;
+        int dy = -j;
+
+        for (int dx = -j; dx <= 0; dx++) {
+            int x = cx + dx * xx + dy * xy;
+            int y = cy + dx * yx + dy * yy;
+            double left = (dx - 0.5) / (dy + 0.5);
+            double right = (dx + 0.5) / (dy - 0.5);
+
+            if (start < right) {
+                continue;
+            }
+            if (end > left) {
+                break;
+            }
+
+            int inside = x >= 0 && y >= 0 && (unsigned int)x < world->width &&
+                         (unsigned int)y < world->height;
+            if (inside && dx * dx + dy * dy <= radius * radius) {
+                world_fov_light(world, x, y);
+            }
+
+            int opaque = world_fov_blocks(world, x, y);
+            if (blocked) {
+                if (opaque) {
+                    next_start = right;
+                } else {
+                    blocked = 0;
+                    start = next_start;
+                }
+            } else if (opaque && j < radius) {
+                blocked = 1;
+                world_fov_cast(world, j + 1, start, left, xx, xy, yx, yy);
+                next_start = right;
+            }
+        }
+
+        if (blocked) {
+            break;
+        }
+    }
+}
+
+// Compute the field of view from the position of the player
+void world_fov_compute(world_t *world) {
+    world_fov *fov = &world->fov;
+
+    // Only the square around the old position can have visible tiles
+    for (unsigned int y = fov->y0; y <= fov->y1 && fov->valid; y++) {
+        for (unsigned int x = fov->x0; x <= fov->x1; x++) {
+            tile_bitset_clear(&fov->visible, x, y);
+        }
+    }
+
+    static const int octants[8][4] = {
+        {1, 0, 0, 1}, {0, 1, 1, 0}, {0, -1, 1, 0}, {-1, 0, 0, 1},
+        {-1, 0, 0, -1}, {0, -1, -1, 0}, {0, 1, -1, 0}, {1, 0, 0, -1},
+    };
+
+    fov->origin = world->player.position;
+    world_fov_light(world, fov->origin.x, fov->origin.y);
+    for (unsigned int i = 0; i < 8; i++) {
+        world_fov_cast(world, 1, 1.0, 0.0, octants[i][0], octants[i][1], octants[i][2],
+                       octants[i][3]);
+    }
+
+    fov->x0 = fov->origin.x > WORLD_FOV_RADIUS ? fov->origin.x - WORLD_FOV_RADIUS : 0;
+    fov->y0 = fov->origin.y > WORLD_FOV_RADIUS ? fov->origin.y - WORLD_FOV_RADIUS : 0;
+    fov->x1 = fov->origin.x + WORLD_FOV_RADIUS < world->width ? fov->origin.x + WORLD_FOV_RADIUS
+                                                              : world->width - 1;
+    fov->y1 = fov->origin.y + WORLD_FOV_RADIUS < world->height ? fov->origin.y + WORLD_FOV_RADIUS
+                                                               : world->height - 1;
+    fov->valid = 1;
+    fov->computations++;
+}
+
+void world_fov_on_commit(world_t *world, const world_journal *journal, void *user) {
+    (void)user;
+    world_fov *fov = &world->fov;
+    int dirty = 0;
+
+    for (unsigned int i = 0; i < journal->changes.count && !dirty; i++) {
+        const world_change *change = (const world_change *)journal->changes.items + i;
+        if (change->kind == WORLD_CHANGE_ENTITY) {
+            dirty = change->id == WORLD_JOURNAL_PLAYER;
+        } else if ((tile_kind_props(change->tile_from)->flags & TILE_OPAQUE) !=
+                   (tile_kind_props(change->tile_to)->flags & TILE_OPAQUE)) {
+            unsigned int x = change->to % world->width;
+            unsigned int y = change->to / world->width;
+            dirty = x >= fov->x0 && x <= fov->x1 && y >= fov->y0 && y <= fov->y1;
+        }
+    }
+
+    if (dirty) {
+        world_fov_compute(world);
+    }
+}
+
+void world_fov_init(world_t *world) {
+    memset(&world->fov, 0, sizeof(world_fov));
+    tile_bitset_init(&world->fov.visible, world->width, world->height);
+    tile_bitset_init(&world->fov.explored, world->width, world->height);
+    world_fov_compute(world);
+    world_journal_subscribe(world, world_fov_on_commit, NULL);
+}
+
+// VIEWPORT
+//
+// Only the part of the map that fits in the terminal is rendered: a window
+// centered on the player that stops at the edges of the map. The size of the
+// terminal is read with TIOCGWINSZ, and read again after a SIGWINCH.
+#define VIEWPORT_DEFAULT_COLUMNS 80 // used when stdout is not a terminal
+#define VIEWPORT_DEFAULT_ROWS 24
+#define VIEWPORT_RESERVED_ROWS 5    // the inventory and the last newline
+
+typedef struct viewport {
+    unsigned int columns; // size of the terminal
+    unsigned int rows;
+    unsigned int x;       // top left tile of the window
+    unsigned int y;
+    unsigned int width;   // size of the window in tiles
+    unsigned int height;
+} viewport;
+
+static volatile sig_atomic_t terminal_resized = 0;
+static struct termios terminal_saved; // mode to restore on exit
+static int terminal_is_raw = 0;
+
+void terminal_restore(void) {
+    if (terminal_is_raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &terminal_saved);
+        terminal_is_raw = 0;
+    }
+}
+
+// Read keys one at a time without echo for as long as the game runs. Output
+// processing is off too, so the frames end their lines with CR-LF.
+//
+// Returns 0 if the terminal is in raw mode, 1 if stdin is not a terminal.
+int terminal_raw(void) {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &terminal_saved) != 0) {
+        return 1;
+    }
+
+    struct termios raw = terminal_saved;
+    cfmakeraw(&raw);
+    if (tcsetattr(STDIN_FILENO, TCSANOW, &raw) != 0) {
+        return 1;
+    }
+    terminal_is_raw = 1;
+    atexit(terminal_restore);
+    return 0;
+}
+
+void terminal_on_resize(int signal) {
+    (void)signal;
+    terminal_resized = 1;
+}
+
+// Read the size of the terminal
+void viewport_resize(viewport *view) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 0) {
+        view->columns = size.ws_col;
+        view->rows = size.ws_row;
+    } else {
+        view->columns = VIEWPORT_DEFAULT_COLUMNS;
+        view->rows = VIEWPORT_DEFAULT_ROWS;
+    }
+}
+
+// First tile of a window of the given size around center, along one axis
+unsigned int viewport_origin(unsigned int center, unsigned int size, unsigned int extent) {
+    if (center < size / 2) {
+        return 0;
+    }
+    unsigned int origin = center - size / 2;
+    return origin + size > extent ? extent - size : origin;
+}
+
+// Move the window over the player, without going past the edges of the map
+void viewport_follow(viewport *view, world_t *world) {
+    unsigned int rows = view->rows > VIEWPORT_RESERVED_ROWS
+                            ? view->rows - VIEWPORT_RESERVED_ROWS
+                            : 1;
+    view->width = view->columns < world->width ? view->columns : world->width;
+    view->height = rows < world->height ? rows : world->height;
+    view->x = viewport_origin(world->player.position.x, view->width, world->width);
+    view->y = viewport_origin(world->player.position.y, view->height, world->height);
+}
+
+// WORLD SNAPSHOTS
+//
+// A snapshot is a copy of everything a frame shows: the tiles and the
+// entities inside the viewport, and the inventory. Frames are printed from
+// snapshots, so the renderer never reads the world while the simulation
+// changes it, and the cost of a frame depends on the size of the terminal,
+// not of the map. The tiles are only copied again when a tile changed or the
+// window moved since the snapshot was last taken. With a field of view, the
+// snapshot also holds what the player sees of the window, and the tiles that
+// the player cannot see are printed from memory or not at all.
+#define SNAPSHOT_UNSEEN 0
+#define SNAPSHOT_EXPLORED 1
+#define SNAPSHOT_VISIBLE 2
+
+typedef struct world_snapshot {
+    viewport view;
+    ds_dynamic_array /* tile_kind */ tiles; // the tiles of the window, by row
+    uint64_t tiles_version; // version of the tiles that were copied
+    entity player;
+    inventory inventory;
+    ds_dynamic_array /* entity */ enemies;
+    ds_dynamic_array /* uint32_t */ indices; // enemies found in the window
+    int fov;                                 // print only what the player sees
+    ds_dynamic_array /* uint8_t */ sight;    // SNAPSHOT_* of each tile
+} world_snapshot;
+
+void world_snapshot_init(world_snapshot *snapshot) {
+    memset(snapshot, 0, sizeof(world_snapshot));
+    ds_dynamic_array_init(&snapshot->tiles, sizeof(tile_kind));
+    ds_dynamic_array_init(&snapshot->enemies, sizeof(entity));
+    ds_dynamic_array_init(&snapshot->indices, sizeof(uint32_t));
+    ds_dynamic_array_init(&snapshot->sight, sizeof(uint8_t));
+    snapshot->tiles_version = UINT64_MAX;
+}
+
+// Copy the state of the world inside the window into the snapshot; the tiles
+// are copied if the snapshot holds another version of them or another window.
+// The field of view is copied if fov is set.
+void world_snapshot_take(world_snapshot *snapshot, world_t *world, viewport view,
+                         uint64_t tiles_version, int fov) {
+    unsigned int tile_count = view.width * view.height;
+    if (snapshot->tiles_version != tiles_version || snapshot->view.x != view.x ||
+        snapshot->view.y != view.y || snapshot->view.width != view.width ||
+        snapshot->view.height != view.height) {
+        if (ds_dynamic_array_reserve(&snapshot->tiles, tile_count) != 0) {
+            DS_PANIC("buy more ram");
+        }
+
+        tile_kind *tiles = (tile_kind *)snapshot->tiles.items;
+        for (unsigned int row = 0; row < view.height; row++) {
+            unsigned int first = (view.y + row) * world->width + view.x;
+            if (world->chunks == NULL) {
+                memcpy(tiles, (const tile_kind *)world->tiles.items + first, view.width);
+            } else {
+                for (unsigned int col = 0; col < view.width; col++) {
+                    tiles[col] = world_get_tile(world, first + col);
+                }
+            }
+            tiles += view.width;
+        }
+
+        snapshot->tiles.count = tile_count;
+        snapshot->tiles_version = tiles_version;
+    }
+
+    snapshot->view = view;
+    snapshot->player = world->player;
+    snapshot->inventory = world->inventory;
+
+    entity_store *store = &world->enemies;
+    snapshot->indices.count = 0;
+    if (entity_store_query(store, view.x, view.y, view.x + view.width - 1,
+                           view.y + view.height - 1, &snapshot->indices) != 0 ||
+        ds_dynamic_array_reserve(&snapshot->enemies, snapshot->indices.count) != 0) {
+        DS_PANIC("buy more ram");
+    }
+    const uint32_t *indices = (const uint32_t *)snapshot->indices.items;
+    entity *enemies = (entity *)snapshot->enemies.items;
+    for (unsigned int k = 0; k < snapshot->indices.count; k++) {
+        enemies[k] = entity_store_get(store, indices[k]);
+    }
+    snapshot->enemies.count = snapshot->indices.count;
+
+    snapshot->fov = fov;
+    if (fov) {
+        if (ds_dynamic_array_reserve(&snapshot->sight, tile_count) != 0) {
+            DS_PANIC("buy more ram");
+        }
+
+        uint8_t *sight = (uint8_t *)snapshot->sight.items;
+        for (unsigned int y = view.y; y < view.y + view.height; y++) {
+            for (unsigned int x = view.x; x < view.x + view.width; x++) {
+                *sight++ = world_is_visible(world, x, y)    ? SNAPSHOT_VISIBLE
+                           : world_is_explored(world, x, y) ? SNAPSHOT_EXPLORED
+                                                            : SNAPSHOT_UNSEEN;
+            }
+        }
+        snapshot->sight.count = tile_count;
+    }
+}
+
+int entity_compare_position(const void *a, const void *b) {
+    const entity *ea = (const entity *)a;
+    const entity *eb = (const entity *)b;
+    if (ea->position.y != eb->position.y) {
+        return ea->position.y < eb->position.y ? -1 : 1;
+    }
+    if (ea->position.x != eb->position.x) {
+        return ea->position.x < eb->position.x ? -1 : 1;
+    }
+    return 0;
+}
+
+// Print the snapshot. The enemies are sorted in print order first, so they
+// are found with a single pass next to the tiles.
+void world_snapshot_print(ds_string_builder *sb, world_snapshot *snapshot) {
+    ds_dynamic_array_sort(&snapshot->enemies, entity_compare_position);
+
+    const viewport *view = &snapshot->view;
+    const tile_kind *tiles = (const tile_kind *)snapshot->tiles.items;
+    const entity *enemies = (const entity *)snapshot->enemies.items;
+    const uint8_t *sight = (const uint8_t *)snapshot->sight.items;
+    unsigned int enemy = 0;
+    unsigned int index = 0;
+    for (unsigned int y = view->y; y < view->y + view->height; y++) {
+        if (y > view->y) {
+            ds_string_builder_appendc(sb, '\n');
+        }
+
+        for (unsigned int x = view->x; x < view->x + view->width; x++, index++) {
+            while (enemy < snapshot->enemies.count &&
+                   (enemies[enemy].position.y < y ||
+                    (enemies[enemy].position.y == y && enemies[enemy].position.x < x))) {
+                enemy++;
+            }
+
+            if (snapshot->fov && sight[index] != SNAPSHOT_VISIBLE) {
+                if (sight[index] == SNAPSHOT_EXPLORED) {
+                    const tile_props *props = tile_kind_props(tiles[index]);
+                    ds_string_builder_appendn(sb, props->memory, props->memory_length);
+                } else {
+                    ds_string_builder_appendc(sb, ' ');
+                }
+            } else if (y == snapshot->player.position.y && x == snapshot->player.position.x) {
+                entity_print(sb, snapshot->player);
+            } else if (enemy < snapshot->enemies.count &&
+                       enemies[enemy].position.y == y && enemies[enemy].position.x == x) {
+                entity_print(sb, enemies[enemy]);
+            } else {
+                tile_kind_print(sb, tiles[index]);
+            }
+        }
+    }
+
+    ds_string_builder_appendc(sb, '\n');
+
+    inventory_print(sb, snapshot->inventory);
+
+    ds_string_builder_appendc(sb, '\n');
+}
+
+void world_snapshot_free(world_snapshot *snapshot) {
+    ds_dynamic_array_free(&snapshot->tiles);
+    ds_dynamic_array_free(&snapshot->enemies);
+    ds_dynamic_array_free(&snapshot->indices);
+    ds_dynamic_array_free(&snapshot->sight);
+}
+
+// Rows of tiles handled by one thread of world_parse
+typedef struct world_parse_job {
+    const char *buffer;
+    unsigned int length;
+    unsigned int width;
+    unsigned int row_begin;
+    unsigned int row_end;
+    unsigned int word_begin;
+    unsigned int word_end;
+    unsigned int tile_count;
+    tile_kind *tiles;
+    uint64_t *passable;
+    ds_dynamic_array /* entity */ enemies;
+    int has_player;
+    uvec2 player;
+    int bad_row; // first row that is not width tiles long, or -1
+} world_parse_job;
+
+#define WORLD_PARSE_MAX_THREADS 64
+#define WORLD_PARSE_MIN_BYTES_PER_THREAD (1 << 20)
+
+// Copy a range of rows into the tiles, pull out the entities and fill the
+// passability bitmap words that belong to the range
+void *world_parse_rows(void *arg) {
+    world_parse_job *job = (world_parse_job *)arg;
+    unsigned int stride = job->width + 1;
+
+    for (unsigned int row = job->row_begin; row < job->row_end; row++) {
+        const char *line = job->buffer + (uint64_t)row * stride;
+        tile_kind *tiles = job->tiles + (uint64_t)row * job->width;
+        memcpy(tiles, line, job->width);
+
+        // A longer row followed by a shorter one would otherwise shift the
+        // rows without a line break ever showing up among the tiles
+        if ((uint64_t)row * stride + job->width < job->length && line[job->width] != '\n' &&
+            job->bad_row < 0) {
+            job->bad_row = row;
+        }
+
+        for (unsigned int col = 0; col < job->width; col++) {
+            uint8_t flags = tile_kind_props(tiles[col])->flags;
+            if ((flags & (TILE_PLAYER | TILE_ENEMY | TILE_LINE_BREAK)) == 0) {
+                continue;
+            }
+
+            if (flags & TILE_PLAYER) {
+                job->has_player = 1;
+                job->player.y = row;
+                job->player.x = col;
+                tiles[col] = FLOOR_CH;
+            } else if (flags & TILE_ENEMY) {
+                entity e = { .position = { .x = col, .y = row }, .symbol = tiles[col] };
+                if (ds_dynamic_array_append(&job->enemies, &e) != 0) {
+                    DS_PANIC("buy more ram");
+                }
+                tiles[col] = FLOOR_CH;
+            } else if (job->bad_row < 0) {
+                job->bad_row = row;
+            }
+        }
+    }
+
+    // Entities stand on floor, so the bitmap can be computed from the raw
+    // buffer without waiting for the neighboring rows
+    if (job->word_begin >= job->word_end) {
+        return NULL;
+    }
+
+    unsigned int row = (uint64_t)job->word_begin * 64 / job->width;
+    unsigned int col = (uint64_t)job->word_begin * 64 % job->width;
+    for (unsigned int word = job->word_begin; word < job->word_end; word++) {
+        uint64_t bits = 0;
+        unsigned int first = word * 64;
+        for (unsigned int i = 0; i < 64 && first + i < job->tile_count; i++) {
+            if (tile_kind_is_impassible(job->buffer[(uint64_t)row * stride + col]) == 0) {
+                bits |= (uint64_t)1 << i;
+            }
+
+            if (++col == job->width) {
+                col = 0;
+                row++;
+            }
+        }
+        job->passable[word] = bits;
+    }
+
+    return NULL;
+}
+
+unsigned int world_parse_threads(unsigned int length) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = cpus > 0 ? (unsigned int)cpus : 1;
+
+    if (threads > WORLD_PARSE_MAX_THREADS) {
+        threads = WORLD_PARSE_MAX_THREADS;
+    }
+    if (threads > length / WORLD_PARSE_MIN_BYTES_PER_THREAD) {
+        threads = length / WORLD_PARSE_MIN_BYTES_PER_THREAD;
+    }
+
+    return threads > 0 ? threads : 1;
+}
+
+// Parse the map directly from the file buffer
+//
+// All the rows must have the same width, so the row boundaries follow from
+// the first line break. The rows are split into one range per thread and the
+// threads copy the tiles, collect the entities and build the passability
+// bitmap into storage that is allocated once up front. The per thread entity
+// lists are merged in row order, so the result is the same for any number of
+// threads.
+void world_parse(char *buffer, unsigned int length, world_t *world) {
+    memset(world, 0, sizeof(world_t));
+    world_journal_init(&world->journal);
+    ds_dynamic_array_init(&world->tiles, sizeof(tile_kind));
+    entity_store_init(&world->enemies);
+
+    ds_string_slice slice;
+    ds_string_slice_init(&slice, buffer, length);
+    unsigned int width = length;
+    ds_string_slice_find(&slice, '\n', &width);
+    unsigned int stride = width + 1;
+    unsigned int height = 0;
+    if (length > 0) {
+        // The last row does not need a line break
+        height = length / stride;
+        if (length % stride == width) {
+            height++;
+        } else if (length % stride != 0) {
+            DS_PANIC("map row %u does not have %u tiles", height, width);
+        }
+    }
+
+    unsigned int tile_count = width * height;
+    unsigned int words = (unsigned int)(((uint64_t)tile_count + 63) / 64);
+    if (ds_dynamic_array_reserve(&world->tiles, tile_count) != 0) {
+        DS_PANIC("buy more ram");
+    }
+    world->passable = DS_MALLOC(NULL, (words > 0 ? words : 1) * sizeof(uint64_t));
+    if (world->passable == NULL) {
+        DS_PANIC("buy more ram");
+    }
+
+    unsigned int threads = world_parse_threads(length);
+    if (threads > height) {
+        threads = height > 0 ? height : 1;
+    }
+
+    world_parse_job jobs[WORLD_PARSE_MAX_THREADS];
+    pthread_t thread_ids[WORLD_PARSE_MAX_THREADS];
+    for (unsigned int i = 0; i < threads; i++) {
+        world_parse_job *job = &jobs[i];
+        memset(job, 0, sizeof(world_parse_job));
+        job->buffer = buffer;
+        job->length = length;
+        job->width = width;
+        job->row_begin = (uint64_t)height * i / threads;
+        job->row_end = (uint64_t)height * (i + 1) / threads;
+        job->word_begin = ((uint64_t)job->row_begin * width + 63) / 64;
+        job->word_end = (i + 1 == threads)
+                            ? words
+                            : ((uint64_t)job->row_end * width + 63) / 64;
+        job->tile_count = tile_count;
+        job->tiles = (tile_kind *)world->tiles.items;
+        job->passable = world->passable;
+        job->bad_row = -1;
+        ds_dynamic_array_init(&job->enemies, sizeof(entity));
+    }
+
+    for (unsigned int i = 1; i < threads; i++) {
+        if (pthread_create(&thread_ids[i], NULL, world_parse_rows, &jobs[i]) != 0) {
+            DS_PANIC("failed to start a parser thread");
+        }
+    }
+    world_parse_rows(&jobs[0]);
+    for (unsigned int i = 1; i < threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    unsigned int enemy_count = 0;
+    for (unsigned int i = 0; i < threads; i++) {
+        enemy_count += jobs[i].enemies.count;
+    }
+    entity_store_reserve(&world->enemies, enemy_count);
+
+    for (unsigned int i = 0; i < threads; i++) {
+        world_parse_job *job = &jobs[i];
+
+        if (job->bad_row >= 0) {
+            DS_PANIC("map row %d does not have %u tiles", job->bad_row, width);
+        }
+
+        if (job->has_player) {
+            world->player.position = job->player;
+            world->player.symbol = PLAYER_CH;
+        }
+
+        for (unsigned int j = 0; j < job->enemies.count; j++) {
+            entity *e = (entity *)job->enemies.items + j;
+            entity_store_add(&world->enemies, e->position.x, e->position.y, e->symbol);
+        }
+        ds_dynamic_array_free(&job->enemies);
+    }
+
+    world->tiles.count = tile_count;
+    world->width = width;
+    world->height = height;
+}
+
+// COMPILED MAPS
+//
+// A .rmap file is a compiled world that can be mmapped and used in place. All
+// the sections start at RMAP_ALIGNMENT and are zero padded, and the checksum
+// covers the whole file, with the checksum field itself taken as 0. The
+// fields are stored in host byte order, which the byte_order field lets the
+// loader verify. The size and the modification time of the text map it was
+// compiled from tell whether the compiled map is still up to date.
+//
+// | header | tiles | passable bitmap | entities | region labels (optional) |
+#define RMAP_MAGIC "RMAP"
+#define RMAP_VERSION 3
+#define RMAP_BYTE_ORDER 0x01020304
+#define RMAP_ALIGNMENT 64
+
+typedef struct rmap_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t width;
+    uint32_t height;
+    uint32_t entity_count;
+    uint32_t player_x;
+    uint32_t player_y;
+    uint64_t tiles_offset;
+    uint64_t passable_offset;
+    uint64_t entities_offset;
+    uint64_t regions_offset; // 0 if the map has no region labels
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t size;
+    uint64_t checksum;
+} rmap_header;
+
+typedef struct rmap_entity {
+    uint32_t x;
+    uint32_t y;
+    uint32_t symbol;
+} rmap_entity;
+
+uint64_t rmap_align(uint64_t offset) {
+    return (offset + RMAP_ALIGNMENT - 1) & ~(uint64_t)(RMAP_ALIGNMENT - 1);
+}
+
+// FNV-1a over 64 bit words, with a final pass over the trailing bytes
+uint64_t rmap_checksum_bytes(uint64_t hash, const uint8_t *data, uint64_t length) {
+    uint64_t i = 0;
+
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+
+    for (; i < length; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Checksum of a file with the given header, where data holds the bytes
+// after the header
+uint64_t rmap_checksum(const rmap_header *header, const uint8_t *data) {
+    rmap_header fields = *header;
+    fields.checksum = 0;
+
+    uint64_t hash = rmap_checksum_bytes(0xcbf29ce484222325ULL, (const uint8_t *)&fields,
+                                        sizeof(rmap_header));
+    return rmap_checksum_bytes(hash, data, header->size - sizeof(rmap_header));
+}
+
+// Record the text map a compiled map is made from
+void rmap_stamp_source(rmap_header *header, const struct stat *source) {
+    header->source_size = source->st_size;
+    header->source_mtime_sec = source->st_mtim.tv_sec;
+    header->source_mtime_nsec = source->st_mtim.tv_nsec;
+}
+
+// Check whether a compiled map was made from the text map as it is now
+int rmap_matches_source(const rmap_header *header, const struct stat *source) {
+    return header->source_size == (uint64_t)source->st_size &&
+           header->source_mtime_sec == source->st_mtim.tv_sec &&
+           header->source_mtime_nsec == source->st_mtim.tv_nsec;
+}
+
+// Check that a section starts after the header, is aligned and ends inside
+// the file, without overflowing
+int rmap_section_fits(const rmap_header *header, uint64_t offset, uint64_t length) {
+    return offset >= sizeof(rmap_header) && offset % RMAP_ALIGNMENT == 0 &&
+           offset <= header->size && length <= header->size - offset;
+}
+
+// Label the connected regions of passable tiles, starting from 1. Impassable
+// tiles get the label 0.
+void world_compute_regions(world_t *world, uint32_t *regions) {
+    unsigned int count = world->width * world->height;
+    memset(regions, 0, count * sizeof(uint32_t));
+
+    ds_dynamic_array stack;
+    ds_dynamic_array_init(&stack, sizeof(unsigned int));
+
+    uint32_t label = 0;
+    for (unsigned int start = 0; start < count; start++) {
+        if (regions[start] != 0 || world_is_passable(world, start) == 0) {
+            continue;
+        }
+
+        label++;
+        regions[start] = label;
+        ds_dynamic_array_append(&stack, &start);
+
+        while (stack.count > 0) {
+            const void *top = NULL;
+            ds_dynamic_array_pop(&stack, &top);
+            unsigned int index = *(const unsigned int *)top;
+            unsigned int row = index / world->width;
+            unsigned int col = index % world->width;
+
+            unsigned int neighbors[4];
+            unsigned int neighbor_count = 0;
+            if (col > 0) neighbors[neighbor_count++] = index - 1;
+            if (col + 1 < world->width) neighbors[neighbor_count++] = index + 1;
+            if (row > 0) neighbors[neighbor_count++] = index - world->width;
+            if (row + 1 < world->height) neighbors[neighbor_count++] = index + world->width;
+
+            for (unsigned int i = 0; i < neighbor_count; i++) {
+                unsigned int neighbor = neighbors[i];
+                if (regions[neighbor] == 0 && world_is_passable(world, neighbor)) {
+                    regions[neighbor] = label;
+                    ds_dynamic_array_append(&stack, &neighbor);
+                }
+            }
+        }
+    }
+
+    ds_dynamic_array_free(&stack);
+}
+
+// Drop the region labels as soon as a tile changes between passable and
+// impassable, because they no longer describe the map
+void world_regions_on_commit(world_t *world, const world_journal *journal, void *user) {
+    (void)user;
+
+    for (unsigned int i = 0; i < journal->changes.count && world->regions != NULL; i++) {
+        const world_change *change = (const world_change *)journal->changes.items + i;
+        if (change->kind == WORLD_CHANGE_TILE &&
+            tile_kind_is_impassible(change->tile_from) !=
+                tile_kind_is_impassible(change->tile_to)) {
+            if (world->map.data == NULL) {
+                DS_FREE(NULL, world->regions);
+            }
+            world->regions = NULL;
+        }
+    }
+}
+
+// Write the world loaded from source_path as a .rmap file
+//
+// Returns 0 if the file was written successfully, 1 otherwise.
+int world_compile(world_t *world, const char *source_path, const char *path, int with_regions) {
+    int result = 0;
+    uint8_t *data = NULL;
+    FILE *file = NULL;
+
+    if (world->chunks != NULL) {
+        DS_LOG_ERROR("a chunked world can not be compiled");
+        return_defer(1);
+    }
+
+    struct stat source;
+    if (stat(source_path, &source) != 0) {
+        DS_LOG_ERROR("failed to stat %s", source_path);
+        return_defer(1);
+    }
+
+    uint64_t tile_count = (uint64_t)world->width * world->height;
+
+    rmap_header header = {0};
+    memcpy(header.magic, RMAP_MAGIC, sizeof(header.magic));
+    header.version = RMAP_VERSION;
+    header.byte_order = RMAP_BYTE_ORDER;
+    rmap_stamp_source(&header, &source);
+    header.width = world->width;
+    header.height = world->height;
+    header.entity_count = world->enemies.count;
+    header.player_x = world->player.position.x;
+    header.player_y = world->player.position.y;
+    header.tiles_offset = rmap_align(sizeof(rmap_header));
+    header.passable_offset = rmap_align(header.tiles_offset + tile_count);
+    header.entities_offset = rmap_align(header.passable_offset +
+                                        (tile_count + 63) / 64 * sizeof(uint64_t));
+    header.size = rmap_align(header.entities_offset +
+                             header.entity_count * sizeof(rmap_entity));
+    if (with_regions) {
+        header.regions_offset = header.size;
+        header.size = rmap_align(header.regions_offset + tile_count * sizeof(uint32_t));
+    }
+
+    data = DS_MALLOC(NULL, header.size);
+    if (data == NULL) {
+        DS_LOG_ERROR("buy more ram");
+        return_defer(1);
+    }
+    memset(data, 0, header.size);
+
+    memcpy(data + header.tiles_offset, world->tiles.items, tile_count);
+    memcpy(data + header.passable_offset, world->passable,
+           (tile_count + 63) / 64 * sizeof(uint64_t));
+
+    rmap_entity *entities = (rmap_entity *)(data + header.entities_offset);
+    for (unsigned int i = 0; i < world->enemies.count; i++) {
+        entities[i].x = world->enemies.x[i];
+        entities[i].y = world->enemies.y[i];
+        entities[i].symbol = (unsigned char)world->enemies.symbol[i];
+    }
+
+    if (with_regions) {
+        world_compute_regions(world, (uint32_t *)(data + header.regions_offset));
+    }
+
+    header.checksum = rmap_checksum(&header, data + sizeof(rmap_header));
+    memcpy(data, &header, sizeof(rmap_header));
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        DS_LOG_ERROR("failed to open %s", path);
+        return_defer(1);
+    }
+
+    if (fwrite(data, 1, header.size, file) != header.size) {
+        DS_LOG_ERROR("failed to write %s", path);
+        return_defer(1);
+    }
+
+defer:
+    if (file != NULL) {
+        fclose(file);
+    }
+    DS_FREE(NULL, data);
+    return result;
+}
+
+int rmap_is_compiled(ds_io_mapping *map) {
+    return map->length >= sizeof(rmap_header) &&
+           memcmp(map->data, RMAP_MAGIC, strlen(RMAP_MAGIC)) == 0;
+}
+
+// Load a world from a mapped .rmap file
+//
+// The tiles, the passability bitmap and the region labels are used in place,
+// so the world takes ownership of the mapping.
+//
+// Returns 0 if the world was loaded successfully, 1 if the file is invalid.
+int world_load_rmap(ds_io_mapping *map, world_t *world) {
+    rmap_header header;
+    memcpy(&header, map->data, sizeof(rmap_header));
+
+    if (header.version != RMAP_VERSION || header.byte_order != RMAP_BYTE_ORDER) {
+        DS_LOG_ERROR("unsupported map version or byte order");
+        return 1;
+    }
+
+    // The tiles are indexed with unsigned int, and every section must fit
+    // in the file before its length is computed from the tile count
+    uint64_t tile_count = (uint64_t)header.width * header.height;
+    if (header.size != map->length || tile_count > UINT_MAX || tile_count > header.size ||
+        !rmap_section_fits(&header, header.tiles_offset, tile_count) ||
+        !rmap_section_fits(&header, header.passable_offset,
+                           (tile_count + 63) / 64 * sizeof(uint64_t)) ||
+        !rmap_section_fits(&header, header.entities_offset,
+                           (uint64_t)header.entity_count * sizeof(rmap_entity)) ||
+        (header.regions_offset != 0 &&
+         !rmap_section_fits(&header, header.regions_offset, tile_count * sizeof(uint32_t)))) {
+        DS_LOG_ERROR("map sections are out of bounds");
+        return 1;
+    }
+
+    uint8_t *data = (uint8_t *)map->data;
+    if (rmap_checksum(&header, data + sizeof(rmap_header)) != header.checksum) {
+        DS_LOG_ERROR("map checksum mismatch");
+        return 1;
+    }
+
+    rmap_entity *entities = (rmap_entity *)(data + header.entities_offset);
+    int inside = header.player_x < header.width && header.player_y < header.height;
+    for (unsigned int i = 0; i < header.entity_count && inside; i++) {
+        inside = entities[i].x < header.width && entities[i].y < header.height;
+    }
+    if (!inside) {
+        DS_LOG_ERROR("map entities are out of bounds");
+        return 1;
+    }
+
+    memset(world, 0, sizeof(world_t));
+    world_journal_init(&world->journal);
+    world->width = header.width;
+    world->height = header.height;
+    world->player.position.x = header.player_x;
+    world->player.position.y = header.player_y;
+    world->player.symbol = PLAYER_CH;
+
+    ds_dynamic_array_init(&world->tiles, sizeof(tile_kind));
+    world->tiles.items = data + header.tiles_offset;
+    world->tiles.count = tile_count;
+    world->tiles.capacity = tile_count;
+
+    world->passable = (uint64_t *)(data + header.passable_offset);
+    if (header.regions_offset != 0) {
+        world->regions = (uint32_t *)(data + header.regions_offset);
+        world_journal_subscribe(world, world_regions_on_commit, NULL);
+    }
+
+    entity_store_init(&world->enemies);
+    entity_store_reserve(&world->enemies, header.entity_count);
+    for (unsigned int i = 0; i < header.entity_count; i++) {
+        entity_store_add(&world->enemies, entities[i].x, entities[i].y,
+                         (char)entities[i].symbol);
+    }
+
+    world->map = *map;
+
+    return 0;
+}
+
+// Get the path of the compiled map next to a text map
+//
+// Returns a new string, or NULL if the path already has the .rmap extension.
+char *rmap_path_for(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    unsigned int stem = (dot != NULL && (slash == NULL || dot > slash))
+                            ? (unsigned int)(dot - path)
+                            : strlen(path);
+
+    if (strcmp(path + stem, RMAP_EXTENSION) == 0) {
+        return NULL;
+    }
+
+    char *result = DS_MALLOC(NULL, stem + strlen(RMAP_EXTENSION) + 1);
+    if (result == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memcpy(result, path, stem);
+    strcpy(result + stem, RMAP_EXTENSION);
+
+    return result;
+}
+
+// A chunked map file holds the tiles of a chunked world, chunk after chunk in
+// row major order. The tiles of the chunks that cross the right or the bottom
+// edge of the map are padded with walls. The index stores the offset of every
+// chunk, so a chunk can be read with a single pread.
+//
+// | header | entities | chunk index | chunks |
+#define RCHK_MAGIC "RCHK"
+#define RCHK_VERSION 1
+
+typedef struct rchk_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t width;
+    uint32_t height;
+    uint32_t chunk_size;
+    uint32_t entity_count;
+    uint32_t player_x;
+    uint32_t player_y;
+    uint32_t reserved;
+    uint64_t entities_offset;
+    uint64_t index_offset;
+} rchk_header;
+
+// Write the world as a chunked map file
+//
+// Returns 0 if the file was written successfully, 1 otherwise.
+int world_write_chunks(world_t *world, const char *path) {
+    int result = 0;
+    FILE *file = NULL;
+    uint64_t *offsets = NULL;
+
+    if (world->chunks != NULL) {
+        DS_LOG_ERROR("the world is already chunked");
+        return_defer(1);
+    }
+
+    unsigned int chunks_x = (world->width + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE;
+    unsigned int chunks_y = (world->height + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE;
+    unsigned int chunk_count = chunks_x * chunks_y;
+
+    rchk_header header = {0};
+    memcpy(header.magic, RCHK_MAGIC, sizeof(header.magic));
+    header.version = RCHK_VERSION;
+    header.byte_order = RMAP_BYTE_ORDER;
+    header.width = world->width;
+    header.height = world->height;
+    header.chunk_size = WORLD_CHUNK_SIZE;
+    header.entity_count = world->enemies.count;
+    header.player_x = world->player.position.x;
+    header.player_y = world->player.position.y;
+    header.entities_offset = sizeof(rchk_header);
+    header.index_offset = header.entities_offset +
+                          header.entity_count * sizeof(rmap_entity);
+
+    offsets = DS_MALLOC(NULL, (chunk_count > 0 ? chunk_count : 1) * sizeof(uint64_t));
+    if (offsets == NULL) {
+        DS_LOG_ERROR("buy more ram");
+        return_defer(1);
+    }
+    uint64_t data_offset = rmap_align(header.index_offset + chunk_count * sizeof(uint64_t));
+    for (unsigned int id = 0; id < chunk_count; id++) {
+        offsets[id] = data_offset + (uint64_t)id * WORLD_CHUNK_TILES;
+    }
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        DS_LOG_ERROR("failed to open %s", path);
+        return_defer(1);
+    }
+
+    if (fwrite(&header, sizeof(rchk_header), 1, file) != 1) {
+        DS_LOG_ERROR("failed to write %s", path);
+        return_defer(1);
+    }
+
+    for (unsigned int i = 0; i < world->enemies.count; i++) {
+        rmap_entity re = { .x = world->enemies.x[i], .y = world->enemies.y[i],
+                           .symbol = (unsigned char)world->enemies.symbol[i] };
+        if (fwrite(&re, sizeof(rmap_entity), 1, file) != 1) {
+            DS_LOG_ERROR("failed to write %s", path);
+            return_defer(1);
+        }
+    }
+
+    if (fwrite(offsets, sizeof(uint64_t), chunk_count, file) != chunk_count ||
+        fseek(file, data_offset, SEEK_SET) != 0) {
+        DS_LOG_ERROR("failed to write %s", path);
+        return_defer(1);
+    }
+
+    tile_kind tiles[WORLD_CHUNK_TILES];
+    for (unsigned int cy = 0; cy < chunks_y; cy++) {
+        for (unsigned int cx = 0; cx < chunks_x; cx++) {
+            memset(tiles, WALL_CH, sizeof(tiles));
+            for (unsigned int row = 0; row < WORLD_CHUNK_SIZE; row++) {
+                unsigned int y = cy * WORLD_CHUNK_SIZE + row;
+                unsigned int x = cx * WORLD_CHUNK_SIZE;
+                if (y >= world->height) {
+                    break;
+                }
+                unsigned int count = world->width - x < WORLD_CHUNK_SIZE
+                                         ? world->width - x
+                                         : WORLD_CHUNK_SIZE;
+                memcpy(tiles + row * WORLD_CHUNK_SIZE,
+                       (tile_kind *)world->tiles.items + (uint64_t)y * world->width + x,
+                       count);
+            }
+
+            if (fwrite(tiles, 1, WORLD_CHUNK_TILES, file) != WORLD_CHUNK_TILES) {
+                DS_LOG_ERROR("failed to write %s", path);
+                return_defer(1);
+            }
+        }
+    }
+
+defer:
+    if (file != NULL) {
+        fclose(file);
+    }
+    DS_FREE(NULL, offsets);
+    return result;
+}
+
+// Check that a section of a file ends inside it, without overflowing
+int rchk_section_fits(uint64_t file_size, uint64_t offset, uint64_t length) {
+    return offset <= file_size && length <= file_size - offset;
+}
+
+// Open a chunked map file as a chunked world
+//
+// Only the header, the entities and the chunk index are read, the chunks are
+// read on demand. The file is opened read only, and reopened for writing the
+// first time a modified chunk is written back to it.
+//
+// Returns 0 if the world was loaded successfully, 1 otherwise.
+int world_load_chunks(const char *path, world_t *world) {
+    int result = 0;
+    rmap_entity *entities = NULL;
+    world_chunks *chunks = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        DS_LOG_ERROR("failed to open %s", path);
+        return_defer(1);
+    }
+
+    rchk_header header;
+    if (pread(fd, &header, sizeof(rchk_header), 0) != sizeof(rchk_header) ||
+        memcmp(header.magic, RCHK_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != RCHK_VERSION || header.byte_order != RMAP_BYTE_ORDER ||
+        header.chunk_size != WORLD_CHUNK_SIZE) {
+        DS_LOG_ERROR("unsupported chunked map %s", path);
+        return_defer(1);
+    }
+
+    // The tiles are indexed with unsigned int, and the index and the
+    // entities must be inside the file before they are allocated
+    struct stat st;
+    uint64_t tile_count = (uint64_t)header.width * header.height;
+    uint64_t chunks_x = ((uint64_t)header.width + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE;
+    uint64_t chunks_y = ((uint64_t)header.height + WORLD_CHUNK_SIZE - 1) / WORLD_CHUNK_SIZE;
+    if (fstat(fd, &st) != 0 || tile_count > UINT_MAX ||
+        header.player_x >= header.width || header.player_y >= header.height ||
+        !rchk_section_fits(st.st_size, header.entities_offset,
+                           (uint64_t)header.entity_count * sizeof(rmap_entity)) ||
+        !rchk_section_fits(st.st_size, header.index_offset,
+                           chunks_x * chunks_y * sizeof(uint64_t))) {
+        DS_LOG_ERROR("chunked map %s is out of bounds", path);
+        return_defer(1);
+    }
+
+    chunks = DS_MALLOC(NULL, sizeof(world_chunks));
+    if (chunks == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(chunks, 0, sizeof(world_chunks));
+    chunks->fd = fd;
+    chunks->path = DS_MALLOC(NULL, strlen(path) + 1);
+    if (chunks->path == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    strcpy(chunks->path, path);
+    chunks->chunks_x = chunks_x;
+    chunks->chunks_y = chunks_y;
+    ds_intrusive_list_init(&chunks->lru);
+
+    unsigned int chunk_count = chunks->chunks_x * chunks->chunks_y;
+    chunks->capacity = chunk_count < WORLD_CHUNK_CACHE ? chunk_count : WORLD_CHUNK_CACHE;
+    chunks->offsets = DS_MALLOC(NULL, (chunk_count > 0 ? chunk_count : 1) * sizeof(uint64_t));
+    chunks->slots = DS_MALLOC(NULL, (chunk_count > 0 ? chunk_count : 1) * sizeof(int32_t));
+    chunks->cache = DS_MALLOC(NULL, (chunks->capacity > 0 ? chunks->capacity : 1) *
+                                        sizeof(world_chunk));
+    if (chunks->offsets == NULL || chunks->slots == NULL || chunks->cache == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(chunks->slots, 0xff, chunk_count * sizeof(int32_t));
+
+    uint64_t index_size = chunk_count * sizeof(uint64_t);
+    if (pread(fd, chunks->offsets, index_size, header.index_offset) != (ssize_t)index_size) {
+        DS_LOG_ERROR("failed to read the chunk index of %s", path);
+        return_defer(1);
+    }
+    for (unsigned int id = 0; id < chunk_count; id++) {
+        if (!rchk_section_fits(st.st_size, chunks->offsets[id], WORLD_CHUNK_TILES)) {
+            DS_LOG_ERROR("chunk %u of %s is out of bounds", id, path);
+            return_defer(1);
+        }
+    }
+
+    uint64_t entities_size = header.entity_count * sizeof(rmap_entity);
+    entities = DS_MALLOC(NULL, entities_size > 0 ? entities_size : 1);
+    if (entities == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    if (pread(fd, entities, entities_size, header.entities_offset) !=
+        (ssize_t)entities_size) {
+        DS_LOG_ERROR("failed to read the entities of %s", path);
+        return_defer(1);
+    }
+    for (unsigned int i = 0; i < header.entity_count; i++) {
+        if (entities[i].x >= header.width || entities[i].y >= header.height) {
+            DS_LOG_ERROR("entity %u of %s is out of bounds", i, path);
+            return_defer(1);
+        }
+    }
+
+    memset(world, 0, sizeof(world_t));
+    world_journal_init(&world->journal);
+    world->width = header.width;
+    world->height = header.height;
+    world->player.position.x = header.player_x;
+    world->player.position.y = header.player_y;
+    world->player.symbol = PLAYER_CH;
+    ds_dynamic_array_init(&world->tiles, sizeof(tile_kind));
+    entity_store_init(&world->enemies);
+    entity_store_reserve(&world->enemies, header.entity_count);
+    for (unsigned int i = 0; i < header.entity_count; i++) {
+        entity_store_add(&world->enemies, entities[i].x, entities[i].y,
+                         (char)entities[i].symbol);
+    }
+
+    world->chunks = chunks;
+    chunks = NULL;
+    fd = -1;
+
+defer:
+    if (chunks != NULL) {
+        DS_FREE(NULL, chunks->path);
+        DS_FREE(NULL, chunks->offsets);
+        DS_FREE(NULL, chunks->slots);
+        DS_FREE(NULL, chunks->cache);
+        DS_FREE(NULL, chunks);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    DS_FREE(NULL, entities);
+    return result;
+}
+
+// Keep the chunks around the player loaded, so that walking does not wait for
+// the disk in the middle of a frame
+void world_stream(world_t *world) {
+    if (world->chunks == NULL) {
+        return;
+    }
+
+    int cx = world->player.position.x / WORLD_CHUNK_SIZE;
+    int cy = world->player.position.y / WORLD_CHUNK_SIZE;
+    for (int y = cy - WORLD_STREAM_RADIUS; y <= cy + WORLD_STREAM_RADIUS; y++) {
+        for (int x = cx - WORLD_STREAM_RADIUS; x <= cx + WORLD_STREAM_RADIUS; x++) {
+            if (x >= 0 && y >= 0 && (unsigned int)x < world->chunks->chunks_x &&
+                (unsigned int)y < world->chunks->chunks_y) {
+                world_chunk_get(world->chunks, x * WORLD_CHUNK_SIZE, y * WORLD_CHUNK_SIZE);
+            }
+        }
+    }
+}
+
+// Load a text map from its compiled sibling, if that was compiled from the
+// text map as it is now
+//
+// Returns 0 if the world was loaded from the compiled map, 1 otherwise.
+int world_load_sibling(const char *path, const struct stat *text_st, world_t *world) {
+    char *compiled = rmap_path_for(path);
+    if (compiled == NULL || access(compiled, R_OK) != 0) {
+        DS_FREE(NULL, compiled);
+        return 1;
+    }
+
+    int result = 1;
+    ds_io_mapping compiled_map;
+    if (ds_io_map_file(compiled, &compiled_map) == 0) {
+        if (!rmap_is_compiled(&compiled_map)) {
+            DS_LOG_WARN("ignoring invalid compiled map %s", compiled);
+        } else if (!rmap_matches_source((rmap_header *)compiled_map.data, text_st)) {
+            DS_LOG_INFO("compiled map %s is out of date", compiled);
+        } else if (world_load_rmap(&compiled_map, world) == 0) {
+            result = 0;
+        } else {
+            DS_LOG_WARN("ignoring invalid compiled map %s", compiled);
+        }
+        if (result != 0) {
+            ds_io_unmap_file(&compiled_map);
+        }
+    }
+
+    DS_FREE(NULL, compiled);
+    return result;
+}
+
+// Load a world from a compiled, a chunked or a text map
+//
+// Compiled and chunked maps are recognized by their magic, which is read
+// before anything is mapped, so a chunked map is only ever read chunk by
+// chunk. For a text map, a compiled map with the same name and the .rmap
+// extension is used instead if it was compiled from the text map as it is
+// now, otherwise the text is parsed.
+//
+// Returns 0 if the world was loaded successfully, 1 otherwise.
+int world_load_file(const char *path, world_t *world) {
+    char magic[4] = {0};
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        DS_LOG_ERROR("failed to open %s", path);
+        return 1;
+    }
+    ssize_t count = pread(fd, magic, sizeof(magic), 0);
+    int stat_result = fstat(fd, &st);
+    close(fd);
+    if (count < 0 || stat_result != 0) {
+        DS_LOG_ERROR("failed to read %s", path);
+        return 1;
+    }
+
+    if (count == sizeof(magic) && memcmp(magic, RCHK_MAGIC, sizeof(magic)) == 0) {
+        return world_load_chunks(path, world);
+    }
+
+    ds_io_mapping map;
+    if (count == sizeof(magic) && memcmp(magic, RMAP_MAGIC, sizeof(magic)) == 0) {
+        if (ds_io_map_file(path, &map) != 0) {
+            return 1;
+        }
+        if (!rmap_is_compiled(&map)) {
+            DS_LOG_ERROR("truncated compiled map %s", path);
+            ds_io_unmap_file(&map);
+            return 1;
+        }
+        if (world_load_rmap(&map, world) != 0) {
+            ds_io_unmap_file(&map);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (world_load_sibling(path, &st, world) == 0) {
+        return 0;
+    }
+
+    if (ds_io_map_file(path, &map) != 0) {
+        return 1;
+    }
+
+    world_parse(map.data, map.length, world);
+    ds_io_unmap_file(&map);
+
+    return 0;
+}
+
+// JOB SYSTEM
+//
+// The per-tick systems split their work into jobs that run on a pool of
+// worker threads. Every worker has its own deque of jobs: it pushes and pops
+// jobs at the bottom, and a worker that runs out of jobs steals from the top
+// of the deque of another one. The thread that submits the jobs is worker 0
+// and runs jobs while it waits for them.
+//
+// A range job calls its function over [begin, end). A worker splits a range
+// that is larger than the grain in two, pushes the upper half as a child job
+// and goes on with the lower half, so the idle workers steal large ranges
+// first. A job is finished when it and all its children are. A job can depend
+// on other jobs and is only started when they are all finished, so the phases
+// of a tick form a graph.
+//
+// The jobs take their scratch memory from a concurrent allocator shared by the
+// workers, so the allocations of a tick do not contend on the heap.
+#define JOB_MAX_WORKERS 64
+#define JOB_MAX_DEPENDENTS 8
+#define JOB_DEQUE_CAPACITY 4096 // a power of two
+#define JOB_POOL_CAPACITY 4096  // unfinished jobs a worker can have, a power of two
+#define JOB_SPINS 64            // failed steals before an idle worker sleeps
+#define JOB_ARENA_SIZE (16 << 20)
+
+typedef void (*job_function)(void *data, unsigned int begin, unsigned int end);
+
+typedef struct job {
+    job_function function;
+    void *data;
+    unsigned int begin;
+    unsigned int end;
+    unsigned int grain;
+    int unfinished; // the job and its children that did not finish yet
+    int pending;    // dependencies that did not finish yet, plus one until submitted
+    struct job *parent;
+    struct job *dependents[JOB_MAX_DEPENDENTS];
+    unsigned int dependent_count;
+} job;
+
+typedef struct job_deque {
+    job *items[JOB_DEQUE_CAPACITY];
+    int64_t top;    // thieves take from here
+    int64_t bottom; // the owner pushes and pops here
+} job_deque;
+
+typedef struct job_worker {
+    job_deque deque;
+    job pool[JOB_POOL_CAPACITY];
+    unsigned int pool_next;
+    uint64_t random;
+    pthread_t thread;
+    struct job_system *system;
+} job_worker;
+
+typedef struct job_system {
+    job_worker *workers;
+    unsigned int worker_count;
+    int running;
+    int queued;   // jobs sitting in a deque
+    int sleeping; // workers waiting for jobs
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint8_t *arena;
+    ds_allocator allocator; // scratch memory of the jobs
+} job_system;
+
+static _Thread_local unsigned int job_worker_index = 0;
+
+// Push at the bottom of the deque, only called by the owner
+//
+// Returns 0 if the job was pushed, 1 if the deque is full
+int job_deque_push(job_deque *deque, job *j) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= JOB_DEQUE_CAPACITY) {
+        return 1;
+    }
+
+    __atomic_store_n(&deque->items[bottom & (JOB_DEQUE_CAPACITY - 1)], j, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Pop from the bottom of the deque, only called by the owner
+job *job_deque_pop(job_deque *deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+
+    if (top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    job *j = __atomic_load_n(&deque->items[bottom & (JOB_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        // The last job, a thief may be taking it at the same time
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+            j = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return j;
+}
+
+// Take a job from the top of the deque of another worker
+job *job_deque_steal(job_deque *deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    job *j = __atomic_load_n(&deque->items[top & (JOB_DEQUE_CAPACITY - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    return j;
+}
+
+void job_execute(job_system *system, job *j);
+
+// Queue a job that is ready to run on the deque of the calling worker, or run
+// it right away if the deque is full
+void job_push(job_system *system, job *j) {
+    job_worker *worker = &system->workers[job_worker_index];
+    if (job_deque_push(&worker->deque, j) != 0) {
+        job_execute(system, j);
+        return;
+    }
+
+    __atomic_add_fetch(&system->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&system->sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&system->lock);
+        pthread_cond_signal(&system->wake);
+        pthread_mutex_unlock(&system->lock);
+    }
+}
+
+// Find a job for the calling worker: its own newest job, or the oldest job of
+// another worker
+job *job_next(job_system *system) {
+    unsigned int self = job_worker_index;
+    job_worker *worker = &system->workers[self];
+
+    job *j = job_deque_pop(&worker->deque);
+    if (j == NULL && system->worker_count > 1) {
+        worker->random ^= worker->random << 13;
+        worker->random ^= worker->random >> 7;
+        worker->random ^= worker->random << 17;
+
+        unsigned int victim = worker->random % system->worker_count;
+        for (unsigned int i = 0; i < system->worker_count && j == NULL; i++) {
+            unsigned int other = (victim + i) % system->worker_count;
+            if (other != self) {
+                j = job_deque_steal(&system->workers[other].deque);
+            }
+        }
+    }
+
+    if (j != NULL) {
+        __atomic_sub_fetch(&system->queued, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return j;
+}
+
+// Mark one part of the job as finished. The last part starts the dependents
+// whose dependencies are all finished and finishes a part of the parent.
+void job_finish(job_system *system, job *j) {
+    while (j != NULL) {
+        // The slot of a finished job can be taken again right away, so what
+        // the last part needs is read before the job is marked
+        job *parent = j->parent;
+        unsigned int dependent_count = j->dependent_count;
+        job *dependents[JOB_MAX_DEPENDENTS];
+        memcpy(dependents, j->dependents, dependent_count * sizeof(job *));
+
+        if (__atomic_sub_fetch(&j->unfinished, 1, __ATOMIC_ACQ_REL) != 0) {
+            break;
+        }
+
+        for (unsigned int i = 0; i < dependent_count; i++) {
+            if (__atomic_sub_fetch(&dependents[i]->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                job_push(system, dependents[i]);
+            }
+        }
+        j = parent;
+    }
+}
+
+// Take a slot from the pool of the calling worker. A slot is free once its
+// job finished; the slots are tried in order, so the oldest ones come first.
+job *job_alloc(job_system *system) {
+    job_worker *worker = &system->workers[job_worker_index];
+    for (unsigned int i = 0; i < JOB_POOL_CAPACITY; i++) {
+        job *j = &worker->pool[worker->pool_next++ & (JOB_POOL_CAPACITY - 1)];
+        if (__atomic_load_n(&j->unfinished, __ATOMIC_ACQUIRE) == 0) {
+            memset(j, 0, sizeof(job));
+            return j;
+        }
+    }
+
+    DS_PANIC("more than %d jobs in flight on worker %u", JOB_POOL_CAPACITY,
+             job_worker_index);
+    return NULL;
+}
+
+void job_execute(job_system *system, job *j) {
+    unsigned int begin = j->begin;
+    unsigned int end = j->end;
+
+    while (end - begin > j->grain) {
+        unsigned int middle = begin + (end - begin) / 2;
+
+        job *child = job_alloc(system);
+        child->function = j->function;
+        child->data = j->data;
+        child->begin = middle;
+        child->end = end;
+        child->grain = j->grain;
+        child->unfinished = 1;
+        child->parent = j;
+
+        __atomic_add_fetch(&j->unfinished, 1, __ATOMIC_RELAXED);
+        job_push(system, child);
+        end = middle;
+    }
+
+    if (begin < end) {
+        j->function(j->data, begin, end);
+    }
+    job_finish(system, j);
+}
+
+void *job_worker_thread(void *arg) {
+    job_worker *worker = (job_worker *)arg;
+    job_system *system = worker->system;
+    job_worker_index = (unsigned int)(worker - system->workers);
+
+    unsigned int spins = 0;
+    while (__atomic_load_n(&system->running, __ATOMIC_ACQUIRE)) {
+        job *j = job_next(system);
+        if (j != NULL) {
+            job_execute(system, j);
+            spins = 0;
+            continue;
+        }
+
+        if (++spins < JOB_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&system->lock);
+        __atomic_add_fetch(&system->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&system->queued, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&system->running, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&system->wake, &system->lock);
+        }
+        __atomic_sub_fetch(&system->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&system->lock);
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+// Start a job system with the given number of workers, counting the calling
+// thread, or one per core if it is 0
+void job_system_init(job_system *system, unsigned int worker_count) {
+    if (worker_count == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    if (worker_count > JOB_MAX_WORKERS) {
+        worker_count = JOB_MAX_WORKERS;
+    }
+
+    memset(system, 0, sizeof(job_system));
+    system->workers = (job_worker *)DS_MALLOC(NULL, worker_count * sizeof(job_worker));
+    if (system->workers == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(system->workers, 0, worker_count * sizeof(job_worker));
+    system->worker_count = worker_count;
+    system->running = 1;
+    system->arena = DS_MALLOC(NULL, JOB_ARENA_SIZE);
+    if (system->arena == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    ds_allocator_init_concurrent(&system->allocator, system->arena, JOB_ARENA_SIZE);
+    pthread_mutex_init(&system->lock, NULL);
+    pthread_cond_init(&system->wake, NULL);
+
+    job_worker_index = 0;
+    for (unsigned int i = 0; i < worker_count; i++) {
+        system->workers[i].system = system;
+        system->workers[i].random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    }
+    for (unsigned int i = 1; i < worker_count; i++) {
+        if (pthread_create(&system->workers[i].thread, NULL, job_worker_thread,
+                           &system->workers[i]) != 0) {
+            DS_PANIC("failed to start a job worker");
+        }
+    }
+}
+
+// Create a job that calls the function over [begin, end) in ranges of at
+// most grain items. It does not run before it is submitted.
+job *job_create(job_system *system, job_function function, void *data, unsigned int begin,
+                unsigned int end, unsigned int grain) {
+    job *j = job_alloc(system);
+    j->function = function;
+    j->data = data;
+    j->begin = begin;
+    j->end = end;
+    j->grain = grain > 0 ? grain : 1;
+    j->unfinished = 1;
+    j->pending = 1;
+    return j;
+}
+
+// Make the job wait for the dependency. Both jobs must not be submitted yet.
+void job_depends_on(job *j, job *dependency) {
+    if (dependency->dependent_count == JOB_MAX_DEPENDENTS) {
+        DS_PANIC("too many dependents");
+    }
+    dependency->dependents[dependency->dependent_count++] = j;
+    j->pending++;
+}
+
+// Let the job run once its dependencies are finished
+void job_submit(job_system *system, job *j) {
+    if (__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        job_push(system, j);
+    }
+}
+
+// Run jobs on the calling thread until the job is finished
+void job_wait(job_system *system, job *j) {
+    while (__atomic_load_n(&j->unfinished, __ATOMIC_ACQUIRE) != 0) {
+        job *next = job_next(system);
+        if (next != NULL) {
+            job_execute(system, next);
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+// Call the function over [0, count) on all the workers and wait for it
+void job_parallel_for(job_system *system, job_function function, void *data,
+                      unsigned int count, unsigned int grain) {
+    job *j = job_create(system, function, data, 0, count, grain);
+    job_submit(system, j);
+    job_wait(system, j);
+}
+
+void job_system_free(job_system *system) {
+    pthread_mutex_lock(&system->lock);
+    __atomic_store_n(&system->running, 0, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&system->wake);
+    pthread_mutex_unlock(&system->lock);
+
+    for (unsigned int i = 1; i < system->worker_count; i++) {
+        pthread_join(system->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&system->lock);
+    pthread_cond_destroy(&system->wake);
+    DS_FREE(NULL, system->arena);
+    DS_FREE(NULL, system->workers);
+}
+
+typedef struct astar_node {
+    uvec2 p;
+    int f;
+} astar_node;
+
+int astar_node_compare_min(const void *a, const void *b) {
+    return ((astar_node *)b)->f - ((astar_node *)a)->f;
+}
+
+int manhattan_distance(uvec2 p1, uvec2 p2) {
+    return abs((int)p1.x - (int)p2.x) + abs((int)p1.y - (int)p2.y);
+}
+
+uint32_t uvec2_hash(struct world *w, uvec2 p) {
+    return p.y * w->width + p.x;
+}
+
+int uvec2_equals(uvec2 p1, uvec2 p2) {
+    return p1.x == p2.x && p1.y == p2.y;
+}
+
+// The tiles a search has reached are kept in an open addressing table keyed
+// by tile index, which grows with the search instead of being sized for the
+// whole map. The table is at most half full.
+#define ASTAR_NONE UINT32_MAX
+#define ASTAR_INITIAL_SLOTS 128 // the table fits in a small allocator block
+
+typedef struct astar_visit {
+    uint32_t tile;      // ASTAR_NONE if the slot is empty
+    uint32_t came_from; // tile preceding this one on the cheapest known path
+    int g_score;        // cost of the cheapest known path from the start
+} astar_visit;
+
+typedef struct astar_visits {
+    astar_visit *slots;
+    uint32_t mask;
+    uint32_t count;
+    ds_allocator *allocator;
+} astar_visits;
+
+void astar_visits_init(astar_visits *visits, uint32_t slot_count, ds_allocator *allocator) {
+    visits->slots = DS_MALLOC(allocator, slot_count * sizeof(astar_visit));
+    if (visits->slots == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    for (uint32_t i = 0; i < slot_count; i++) {
+        visits->slots[i].tile = ASTAR_NONE;
+    }
+    visits->mask = slot_count - 1;
+    visits->count = 0;
+    visits->allocator = allocator;
+}
+
+// Get the visit of a tile, adding it with no path yet if it was not reached
+// before. The pointer is valid until the next call.
+astar_visit *astar_visits_get(astar_visits *visits, uint32_t tile) {
+    uint32_t slot = (tile * 0x9e3779b1u) & visits->mask;
+    while (visits->slots[slot].tile != ASTAR_NONE) {
+        if (visits->slots[slot].tile == tile) {
+            return &visits->slots[slot];
+        }
+        slot = (slot + 1) & visits->mask;
+    }
+
+    if ((visits->count + 1) * 2 > visits->mask + 1) {
+        astar_visits grown;
+        astar_visits_init(&grown, (visits->mask + 1) * 2, visits->allocator);
+        for (uint32_t i = 0; i <= visits->mask; i++) {
+            if (visits->slots[i].tile != ASTAR_NONE) {
+                *astar_visits_get(&grown, visits->slots[i].tile) = visits->slots[i];
+            }
+        }
+        DS_FREE(visits->allocator, visits->slots);
+        *visits = grown;
+        return astar_visits_get(visits, tile);
+    }
+
+    astar_visit *visit = &visits->slots[slot];
+    visit->tile = tile;
+    visit->came_from = ASTAR_NONE;
+    visit->g_score = INT_MAX;
+    visits->count++;
+    return visit;
+}
+
+int reconstruct_path(struct world *w, astar_visits *visits, uvec2 current,
+                     ds_dynamic_array *p) {
+    ds_dynamic_array_append(p, &current);
+    uint32_t current_index = astar_visits_get(visits, uvec2_hash(w, current))->came_from;
+
+    while (current_index != ASTAR_NONE) {
+        uvec2 current = {current_index % w->width, current_index / w->width};
+        ds_dynamic_array_append(p, &current);
+        current_index = astar_visits_get(visits, current_index)->came_from;
+    }
+
+    return 0;
+}
+
+const uvec2 directions[] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+const int num_directions = sizeof(directions) / sizeof(directions[0]);
+
+// Find a path from start to end, taking the memory of the search from the
+// allocator, or from the heap if it is NULL
+int a_star(world_t *w, uvec2 start, uvec2 end, ds_dynamic_array /* uvec2 */ *p,
+           ds_allocator *allocator) {
+    int result = 0;
+
+    // The set of discovered nodes that may need to be (re-)expanded.
+    // Initially, only the start node is known.
+    // This is usually implemented as a min-heap or priority queue rather than a
+    // hash-set.
+    ds_priority_queue open_set;
+    ds_priority_queue_init_allocator(&open_set, astar_node_compare_min, sizeof(astar_node),
+                                     allocator);
+
+    struct astar_node start_node = { start, manhattan_distance(start, end) };
+    ds_priority_queue_insert(&open_set, &start_node);
+
+    // For node n, the visit of n holds cameFrom[n], the node immediately
+    // preceding it on the cheapest path from the start to n currently known,
+    // and gScore[n], the cost of that path. fScore[n] := gScore[n] + h(n) is
+    // only needed when n is queued, so it is not stored.
+    astar_visits visits;
+    astar_visits_init(&visits, ASTAR_INITIAL_SLOTS, allocator);
+    astar_visits_get(&visits, uvec2_hash(w, start))->g_score = 0;
+
+    astar_node current_node = {0};
+    while (ds_priority_queue_empty(&open_set) == 0) {
+        // This operation can occur in O(Log(N)) time if openSet is a min-heap
+        // or a priority queue
+        ds_priority_queue_pull(&open_set, (void *)&current_node);
+        uint32_t current_index = uvec2_hash(w, current_node.p);
+
+        uvec2 current = current_node.p;
+
+        if (uvec2_equals(current_node.p, end)) {
+            reconstruct_path(w, &visits, current_node.p, p);
+            return_defer(1);
+        }
+
+        int current_g_score = astar_visits_get(&visits, current_index)->g_score;
+        for (int i = 0; i < num_directions; i++) {
+            uvec2 neighbor = {current.x + directions[i].x, current.y + directions[i].y};
+            uint32_t neighbor_index = uvec2_hash(w, neighbor);
+
+            if (neighbor.x >= w->width || neighbor.y >= w->height ||
+                world_is_passable(w, neighbor_index) == 0) {
+                continue;
+            }
+
+            // d(current,neighbor) is the weight of the edge from current to
+            // neighbor tentative_gScore is the distance from start to the
+            // neighbor through current
+            int tentative_g_score = current_g_score + 1;
+            astar_visit *visit = astar_visits_get(&visits, neighbor_index);
+            if (tentative_g_score < visit->g_score) {
+                // This path to neighbor is better than any previous one.
+                visit->came_from = current_index;
+                visit->g_score = tentative_g_score;
+
+                int found = 0;
+                for (unsigned int j = 0; j < open_set.items.count; j++) {
+                    astar_node node;
+                    ds_dynamic_array_get(&open_set.items, j, &node);
+
+                    if (uvec2_equals(node.p, neighbor)) {
+                        found = 1;
+                        break;
+                    }
+                }
+
+                if (found == 0) {
+                    astar_node neighbor_node = {
+                        neighbor, tentative_g_score + manhattan_distance(neighbor, end)};
+                    ds_priority_queue_insert(&open_set, &neighbor_node);
+                }
+            }
+        }
+    }
+
+defer:
+    ds_priority_queue_free(&open_set);
+    DS_FREE(allocator, visits.slots);
+
+    return result;
+}
+
+double clock_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ENEMY MOVEMENT
+//
+// The enemies move in two phases. First every enemy proposes a step against
+// the positions of the enemies at the start of the tick: the next tile of its
+// path, if no enemy stands there. Then the conflicts are resolved: when several
+// enemies propose the same tile, the one with the lowest id gets it and the
+// others stay. Both phases run in parallel and the outcome only depends on the
+// ids, not on the number of threads or the order of the jobs. The winners are
+// moved last, on one thread, in store order.
+//
+// The proposed tiles are claimed in an open addressing table with twice as
+// many slots as there are enemies, so two enemies that propose the same tile
+// find the same slot.
+typedef struct enemy_claim {
+    uint32_t tile;   // claimed tile, or ENTITY_NONE if the slot is empty
+    uint32_t winner; // lowest id of the enemies that proposed the tile
+} enemy_claim;
+
+typedef struct enemy_moves {
+    world_t *world;
+    uint32_t *actors; // store index of the enemies that act, in store order
+    unsigned int count;
+    uvec2 *steps; // next tile of each actor, its own tile if it does not move
+    enemy_claim *claims;
+    uint32_t claim_mask;
+} enemy_moves;
+
+enemy_claim *enemy_moves_claim(enemy_moves *moves, uint32_t tile) {
+    uint32_t slot = (tile * 0x9e3779b1u) & moves->claim_mask;
+
+    for (;;) {
+        enemy_claim *claim = &moves->claims[slot];
+        uint32_t current = __atomic_load_n(&claim->tile, __ATOMIC_ACQUIRE);
+        if (current == ENTITY_NONE) {
+            uint32_t empty = ENTITY_NONE;
+            if (__atomic_compare_exchange_n(&claim->tile, &empty, tile, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                return claim;
+            }
+            current = empty;
+        }
+        if (current == tile) {
+            return claim;
+        }
+        slot = (slot + 1) & moves->claim_mask;
+    }
+}
+
+// Enemies that the player can see are always near, however far they are
+unsigned int enemy_lod_tier(world_t *world, uvec2 position) {
+    int distance = manhattan_distance(position, world->player.position);
+    if (distance <= ENEMY_LOD_NEAR_RADIUS ||
+        world_is_visible(world, position.x, position.y)) {
+        return ENEMY_LOD_NEAR;
+    }
+    if (distance <= ENEMY_LOD_MID_RADIUS) {
+        return ENEMY_LOD_MID;
+    }
+    return ENEMY_LOD_FAR;
+}
+
+// Take one step towards the target without looking for a path: along the
+// axis where the target is further away first, then along the other one
+uvec2 greedy_step(world_t *world, uvec2 from, uvec2 to) {
+    int dx = (int)to.x - (int)from.x;
+    int dy = (int)to.y - (int)from.y;
+    uvec2 along_x = { from.x + (dx > 0) - (dx < 0), from.y };
+    uvec2 along_y = { from.x, from.y + (dy > 0) - (dy < 0) };
+
+    uvec2 steps[2] = { along_x, along_y };
+    if (abs(dx) < abs(dy)) {
+        steps[0] = along_y;
+        steps[1] = along_x;
+    }
+
+    for (unsigned int i = 0; i < 2; i++) {
+        uvec2 step = steps[i];
+        if (!uvec2_equals(step, from) && step.x < world->width && step.y < world->height &&
+            world_is_passable(world, step.y * world->width + step.x)) {
+            return step;
+        }
+    }
+    return from;
+}
+
+// Propose the next step of the actors in [begin, end) and claim its tile. The
+// paths only depend on the tiles, so the enemies can plan in parallel.
+void world_plan_enemies(void *data, unsigned int begin, unsigned int end) {
+    enemy_moves *moves = (enemy_moves *)data;
+    world_t *world = moves->world;
+    entity_store *enemies = &world->enemies;
+    uint64_t actions[ENEMY_LOD_TIERS] = {0};
+    uint64_t nanoseconds[ENEMY_LOD_TIERS] = {0};
+    ds_allocator *allocator = world->jobs != NULL ? &world->jobs->allocator : NULL;
+
+    for (unsigned int k = begin; k < end; k++) {
+        uint32_t i = moves->actors[k];
+        double start = clock_seconds();
+
+        uvec2 position = { .x = enemies->x[i], .y = enemies->y[i] };
+        unsigned int tier = enemy_lod_tier(world, position);
+
+        uvec2 step = position;
+        if (tier == ENEMY_LOD_NEAR) {
+            ds_dynamic_array p;
+            ds_dynamic_array_init_allocator(&p, sizeof(uvec2), allocator);
+
+            a_star(world, position, world->player.position, &p, allocator);
+            if (p.count >= 2) {
+                ds_dynamic_array_get(&p, p.count - 2, &step);
+            }
+
+            ds_dynamic_array_free(&p);
+        } else {
+            step = greedy_step(world, position, world->player.position);
+        }
+
+        // Enemies do not walk into each other
+        if (entity_store_at(enemies, step.x, step.y) != ENTITY_NONE) {
+            step = position;
+        }
+        moves->steps[k] = step;
+
+        if (step.x != position.x || step.y != position.y) {
+            enemy_claim *claim = enemy_moves_claim(moves, step.y * world->width + step.x);
+            uint32_t id = enemies->id[i];
+            uint32_t winner = __atomic_load_n(&claim->winner, __ATOMIC_RELAXED);
+            while (id < winner &&
+                   !__atomic_compare_exchange_n(&claim->winner, &winner, id, 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+        }
+
+        actions[tier]++;
+        nanoseconds[tier] += (uint64_t)((clock_seconds() - start) * 1e9);
+    }
+
+    for (unsigned int tier = 0; tier < ENEMY_LOD_TIERS; tier++) {
+        __atomic_add_fetch(&world->lod.actions[tier], actions[tier], __ATOMIC_RELAXED);
+        __atomic_add_fetch(&world->lod.nanoseconds[tier], nanoseconds[tier], __ATOMIC_RELAXED);
+    }
+}
+
+// Keep the actors in [begin, end) in place if they lost the tile they proposed
+void world_resolve_enemies(void *data, unsigned int begin, unsigned int end) {
+    enemy_moves *moves = (enemy_moves *)data;
+    world_t *world = moves->world;
+    entity_store *enemies = &world->enemies;
+
+    for (unsigned int k = begin; k < end; k++) {
+        uint32_t i = moves->actors[k];
+        uvec2 step = moves->steps[k];
+        if (step.x == enemies->x[i] && step.y == enemies->y[i]) {
+            continue;
+        }
+
+        enemy_claim *claim = enemy_moves_claim(moves, step.y * world->width + step.x);
+        if (claim->winner != enemies->id[i]) {
+            moves->steps[k] = (uvec2){ .x = enemies->x[i], .y = enemies->y[i] };
+        }
+    }
+}
+
+// Move the actors that won their tile, in store order
+void world_move_enemies(void *data, unsigned int begin, unsigned int end) {
+    (void)begin;
+    (void)end;
+    enemy_moves *moves = (enemy_moves *)data;
+    world_t *world = moves->world;
+    entity_store *enemies = &world->enemies;
+
+    for (unsigned int k = 0; k < moves->count; k++) {
+        uint32_t i = moves->actors[k];
+        uvec2 step = moves->steps[k];
+        if (step.x != enemies->x[i] || step.y != enemies->y[i]) {
+            world_move_enemy(world, i, step.x, step.y);
+        }
+    }
+}
+
+#define ENEMY_PLAN_JOBS_PER_WORKER 16
+
+int actor_compare_index(const void *a, const void *b) {
+    uint32_t ia = *(const uint32_t *)a;
+    uint32_t ib = *(const uint32_t *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Move the given enemies, given by store index in store order, one step
+void world_act_enemies(world_t *world, uint32_t *actors, unsigned int count) {
+    uint32_t claim_count = 1;
+    while (claim_count < 2 * count) {
+        claim_count *= 2;
+    }
+
+    enemy_moves moves = { .world = world, .actors = actors, .count = count,
+                          .claim_mask = claim_count - 1 };
+    moves.steps = (uvec2 *)DS_MALLOC(NULL, count * sizeof(uvec2));
+    moves.claims = (enemy_claim *)DS_MALLOC(NULL, claim_count * sizeof(enemy_claim));
+    if (moves.steps == NULL || moves.claims == NULL) {
+        DS_PANIC("buy more ram");
+    }
+    memset(moves.claims, 0xff, claim_count * sizeof(enemy_claim));
+
+    // Chunked worlds load chunks while finding paths, so they stay on one thread
+    job_system *jobs = world->jobs;
+    if (jobs != NULL && world->chunks == NULL) {
+        unsigned int grain = count / (jobs->worker_count * ENEMY_PLAN_JOBS_PER_WORKER);
+
+        job *plan = job_create(jobs, world_plan_enemies, &moves, 0, count, grain);
+        job *resolve = job_create(jobs, world_resolve_enemies, &moves, 0, count, grain);
+        job *move = job_create(jobs, world_move_enemies, &moves, 0, 1, 1);
+        job_depends_on(resolve, plan);
+        job_depends_on(move, resolve);
+        job_submit(jobs, move);
+        job_submit(jobs, resolve);
+        job_submit(jobs, plan);
+        job_wait(jobs, move);
+    } else {
+        world_plan_enemies(&moves, 0, count);
+        world_resolve_enemies(&moves, 0, count);
+        world_move_enemies(&moves, 0, 1);
+    }
+
+    DS_FREE(NULL, moves.claims);
+    DS_FREE(NULL, moves.steps);
+}
+
+// Units until an actor with this speed has the energy for its next action
+uint64_t entity_action_delay(uint8_t speed) {
+    uint64_t delay = (uint64_t)SCHEDULER_TURN * ENTITY_ACTION_COST / speed;
+    return delay > 0 ? delay : 1;
+}
+
+// Schedule the first action of every enemy
+void world_schedule_enemies(world_t *world) {
+    actor_scheduler_init(&world->scheduler);
+    ds_dynamic_array_init(&world->due, sizeof(scheduled_event));
+    ds_dynamic_array_init(&world->actors, sizeof(uint32_t));
+
+    entity_store *enemies = &world->enemies;
+    for (unsigned int i = 0; i < enemies->count; i++) {
+        if (enemies->speed[i] > 0) {
+            actor_scheduler_schedule(&world->scheduler, entity_action_delay(enemies->speed[i]),
+                                     SCHEDULE_ENEMY, enemies->id[i],
+                                     entity_store_generation(enemies, enemies->id[i]));
+        }
+    }
+}
+
+// Play one turn: advance the time by SCHEDULER_TURN units and run the events
+// that come due, unit by unit. The enemies that act on the same unit move
+// together.
+void world_update_enemies(world_t *world) {
+    entity_store *enemies = &world->enemies;
+    actor_scheduler *scheduler = &world->scheduler;
+
+    for (unsigned int unit = 0; unit < SCHEDULER_TURN; unit++) {
+        world->due.count = 0;
+        actor_scheduler_advance(scheduler, &world->due);
+        if (world->due.count == 0) {
+            continue;
+        }
+
+        const scheduled_event *due = (const scheduled_event *)world->due.items;
+        world->actors.count = 0;
+        for (unsigned int e = 0; e < world->due.count; e++) {
+            if (due[e].kind == SCHEDULE_ENEMY) {
+                // The events of a removed enemy are dropped here, also when
+                // its id was given to a new one in the meantime
+                uint32_t i = entity_store_index(enemies, due[e].id);
+                if (i == ENTITY_NONE ||
+                    entity_store_generation(enemies, due[e].id) != due[e].generation) {
+                    continue;
+                }
+                if (ds_dynamic_array_append(&world->actors, &i) != 0) {
+                    DS_PANIC("buy more ram");
+                }
+            }
+        }
+
+        uint32_t *actors = (uint32_t *)world->actors.items;
+        unsigned int count = world->actors.count;
+        if (count == 0) {
+            continue;
+        }
+
+        qsort(actors, count, sizeof(uint32_t), actor_compare_index);
+        world_act_enemies(world, actors, count);
+
+        for (unsigned int k = 0; k < count; k++) {
+            uint32_t i = actors[k];
+            if (enemies->speed[i] == 0) {
+                continue;
+            }
+
+            uint64_t delay = entity_action_delay(enemies->speed[i]);
+            uvec2 position = { .x = enemies->x[i], .y = enemies->y[i] };
+            if (enemy_lod_tier(world, position) == ENEMY_LOD_FAR) {
+                delay *= ENEMY_LOD_FAR_INTERVAL;
+            }
+            actor_scheduler_schedule(scheduler, scheduler->now + delay, SCHEDULE_ENEMY,
+                                     enemies->id[i],
+                                     entity_store_generation(enemies, enemies->id[i]));
+        }
+    }
+}
+
+// Load a world from a text map, a compiled map or a chunked map
+//
+// Returns 0 if the world was loaded, 1 otherwise.
+int world_load(const char *path, world_t *world) {
+    if (world_load_file(path, world) != 0) {
+        return 1;
+    }
+
+    world_fov_init(world);
+    world_schedule_enemies(world);
+    return 0;
+}
+
+uint64_t hash_u64(uint64_t hash, uint64_t value) {
+    return (hash ^ value) * 0x100000001b3ULL;
+}
+
+// Hash the state of the world: the tiles, the player, the inventory and the
+// enemies in store order. Two runs that end in the same state have the same
+// hash, whatever the storage of the tiles.
+uint64_t world_hash(world_t *world) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned int tile_count = world->width * world->height;
+
+    for (unsigned int index = 0; index < tile_count; index++) {
+        hash = hash_u64(hash, (unsigned char)world_get_tile(world, index));
+    }
+
+    hash = hash_u64(hash, world->player.position.x);
+    hash = hash_u64(hash, world->player.position.y);
+    hash = hash_u64(hash, world->inventory.keys);
+    hash = hash_u64(hash, world->inventory.gold);
+
+    for (unsigned int i = 0; i < world->enemies.count; i++) {
+        hash = hash_u64(hash, world->enemies.x[i]);
+        hash = hash_u64(hash, world->enemies.y[i]);
+        hash = hash_u64(hash, (unsigned char)world->enemies.symbol[i]);
+    }
+
+    return hash;
+}
+
+// INPUT LOGS
+//
+// An input log records the key of every tick that had one, so that a session
+// can be replayed exactly. Each event also stores a running hash of the world
+// journal after the tick, and the log stores the full world hash before the
+// first tick and after the last one, so a replay can check that it follows
+// the recording tick by tick and report the first tick where it diverges.
+//
+// | header | events |
+#define INPUT_LOG_MAGIC "RLOG"
+#define INPUT_LOG_VERSION 4 // bumped when the same keys lead to another world
+
+typedef struct input_log_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t event_count;
+    uint32_t tick_count;
+    uint64_t initial_hash;
+    uint64_t final_hash;
+} input_log_header;
+
+typedef struct input_event {
+    uint32_t tick;
+    uint32_t key;
+    uint64_t hash; // running journal hash after the tick
+} input_event;
+
+typedef struct input_log {
+    input_log_header header;
+    ds_dynamic_array /* input_event */ events;
+} input_log;
+
+void input_log_init(input_log *log, uint64_t initial_hash) {
+    memset(log, 0, sizeof(input_log));
+    memcpy(log->header.magic, INPUT_LOG_MAGIC, sizeof(log->header.magic));
+    log->header.version = INPUT_LOG_VERSION;
+    log->header.initial_hash = initial_hash;
+    ds_dynamic_array_init(&log->events, sizeof(input_event));
+}
+
+void input_log_record(input_log *log, uint32_t tick, char key, uint64_t hash) {
+    input_event event = { .tick = tick, .key = (unsigned char)key, .hash = hash };
+    if (ds_dynamic_array_append(&log->events, &event) != 0) {
+        DS_PANIC("buy more ram");
+    }
+}
+
+// Write the log with the number of ticks and the final world hash
+//
+// Returns 0 if the log was written successfully, 1 otherwise.
+int input_log_write(input_log *log, const char *path, uint32_t tick_count,
+                    uint64_t final_hash) {
+    int result = 0;
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL) {
+        DS_LOG_ERROR("failed to open %s", path);
+        return_defer(1);
+    }
+
+    log->header.event_count = log->events.count;
+    log->header.tick_count = tick_count;
+    log->header.final_hash = final_hash;
+    if (fwrite(&log->header, sizeof(input_log_header), 1, file) != 1 ||
+        fwrite(log->events.items, sizeof(input_event), log->events.count, file) !=
+            log->events.count) {
+        DS_LOG_ERROR("failed to write %s", path);
+        return_defer(1);
+    }
+
+defer:
+    if (file != NULL) {
+        fclose(file);
+    }
+    return result;
+}
+
+// Read a log written by input_log_write
+//
+// Returns 0 if the log was read successfully, 1 otherwise.
+int input_log_read(input_log *log, const char *path) {
+    int result = 0;
+    ds_io_mapping map = {0};
+
+    input_log_init(log, 0);
+    if (ds_io_map_file(path, &map) != 0) {
+        return_defer(1);
+    }
+
+    input_log_header header;
+    if (map.length < sizeof(input_log_header)) {
+        DS_LOG_ERROR("%s is not an input log", path);
+        return_defer(1);
+    }
+    memcpy(&header, map.data, sizeof(input_log_header));
+
+    if (memcmp(header.magic, INPUT_LOG_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INPUT_LOG_VERSION ||
+        map.length != sizeof(input_log_header) +
+                          (uint64_t)header.event_count * sizeof(input_event)) {
+        DS_LOG_ERROR("%s is not an input log", path);
+        return_defer(1);
+    }
+
+    log->header = header;
+    if (ds_dynamic_array_append_many(&log->events,
+                                     (void **)(map.data + sizeof(input_log_header)),
+                                     header.event_count) != 0) {
+        DS_PANIC("buy more ram");
+    }
+
+defer:
+    if (map.data != NULL) {
+        ds_io_unmap_file(&map);
+    }
+    return result;
+}
+
+void input_log_free(input_log *log) {
+    ds_dynamic_array_free(&log->events);
+}
+
+// Fold every tick of the journal into a running hash. It changes with each
+// tile change and entity move, so it can be compared after every tick
+// without hashing the whole world.
+void journal_hash_on_commit(world_t *world, const world_journal *journal, void *user) {
+    uint64_t hash = *(uint64_t *)user;
+
+    hash = hash_u64(hash, journal->tick);
+    for (unsigned int i = 0; i < journal->changes.count; i++) {
+        const world_change *change = (const world_change *)journal->changes.items + i;
+        hash = hash_u64(hash, change->kind);
+        hash = hash_u64(hash, change->id);
+        hash = hash_u64(hash, change->from);
+        hash = hash_u64(hash, change->to);
+        hash = hash_u64(hash, (unsigned char)change->tile_to);
+    }
+    hash = hash_u64(hash, world->inventory.keys);
+    hash = hash_u64(hash, world->inventory.gold);
+
+    *(uint64_t *)user = hash;
+}
+
+// HEADLESS MODE
+//
+// Runs the simulation as fast as possible, without rendering, without the
+// input thread and without sleeping, and reports how long each phase of the
+// tick took. The input of every tick comes from a script, one character per
+// tick ('.' for no input, line breaks are skipped, the script starts over
+// when it ends), from an input log that is replayed and verified, or from a
+// random generator seeded with the given seed.
+typedef struct headless_options {
+    unsigned int ticks;
+    uint64_t seed;
+    const char *script_path;
+    const char *record_path;
+    const char *replay_path;
+} headless_options;
+
+// xorshift64*, so that the input of a seed is the same on every platform
+uint64_t random_next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// Returns 0 if the simulation ran (and the replay matched the recording), 1
+// otherwise.
+int run_headless(world_t *world, headless_options options) {
+    int result = 0;
+    const char keys[] = { 0, MOVE_UP, MOVE_LEFT, MOVE_DOWN, MOVE_RIGHT };
+    ds_io_mapping script = {0};
+    unsigned int cursor = 0;
+    uint64_t state = options.seed != 0 ? options.seed : 1;
+    input_log replay = {0};
+    input_log record = {0};
+    unsigned int next_event = 0;
+
+    uint64_t journal_hash = world_hash(world);
+    world_journal_subscribe(world, journal_hash_on_commit, &journal_hash);
+    input_log_init(&record, journal_hash);
+
+    if (options.replay_path != NULL) {
+        if (input_log_read(&replay, options.replay_path) != 0) {
+            return_defer(1);
+        }
+        if (replay.header.initial_hash != journal_hash) {
+            DS_LOG_ERROR("%s was recorded on a different world", options.replay_path);
+            return_defer(1);
+        }
+        options.ticks = replay.header.tick_count;
+    } else if (options.script_path != NULL) {
+        if (ds_io_map_file(options.script_path, &script) != 0) {
+            return_defer(1);
+        }
+        ds_string_slice lines;
+        ds_string_slice_init(&lines, script.data, script.length);
+        if (ds_string_slice_count(&lines, '\n') == script.length) {
+            DS_LOG_ERROR("the input script %s is empty", options.script_path);
+            return_defer(1);
+        }
+    }
+
+    double input_time = 0;
+    double enemies_time = 0;
+    double journal_time = 0;
+    unsigned int ticks = 0;
+    unsigned int moves = 0;
+
+    double start = clock_seconds();
+    for (; ticks < options.ticks; ticks++) {
+        char key = 0;
+        input_event *event = NULL;
+        if (replay.events.items != NULL) {
+            if (next_event < replay.events.count &&
+                ((input_event *)replay.events.items)[next_event].tick == ticks) {
+                event = (input_event *)replay.events.items + next_event++;
+                key = event->key;
+            }
+        } else if (script.data != NULL) {
+            while (script.data[cursor % script.length] == '\n') {
+                cursor++;
+            }
+            key = script.data[cursor++ % script.length];
+            key = (key == '.') ? 0 : key;
+        } else {
+            key = keys[random_next(&state) % sizeof(keys)];
+        }
+
+        if (key == QUIT_KEY) {
+            input_log_record(&record, ticks, key, journal_hash);
+            break;
+        }
+
+        double t0 = clock_seconds();
+        handle_input(world, key);
+        double t1 = clock_seconds();
+        if (key != 0) {
+            world_update_enemies(world);
+        }
+        double t2 = clock_seconds();
+        moves += world->journal.changes.count;
+        world_journal_commit(world);
+        double t3 = clock_seconds();
+
+        input_time += t1 - t0;
+        enemies_time += t2 - t1;
+        journal_time += t3 - t2;
+
+        if (key != 0) {
+            input_log_record(&record, ticks, key, journal_hash);
+        }
+        if (event != NULL && event->hash != journal_hash) {
+            DS_LOG_ERROR("the replay diverged from the recording at tick %u", ticks);
+            result = 1;
+            ticks++;
+            break;
+        }
+
+#ifdef DS_AL_STATS
+        ds_allocator_stats_tick();
+#endif
+    }
+    double elapsed = clock_seconds() - start;
+
+    printf("ticks: %u\n", ticks);
+    printf("time: %.3f ms (%.0f ticks/s)\n", elapsed * 1e3,
+           elapsed > 0 ? ticks / elapsed : 0);
+    printf("input: %.3f ms\n", input_time * 1e3);
+    printf("enemies: %.3f ms\n", enemies_time * 1e3);
+    static const char *tiers[ENEMY_LOD_TIERS] = { "near", "mid", "far" };
+    for (unsigned int tier = 0; tier < ENEMY_LOD_TIERS; tier++) {
+        printf("  %s: %llu actions, %.3f ms\n", tiers[tier],
+               (unsigned long long)world->lod.actions[tier],
+               world->lod.nanoseconds[tier] * 1e-6);
+    }
+    printf("journal: %.3f ms\n", journal_time * 1e3);
+    printf("changes: %u\n", moves);
+
+    uint64_t final_hash = world_hash(world);
+    printf("hash: %016llx\n", (unsigned long long)final_hash);
+
+    if (result == 0 && replay.events.items != NULL &&
+        final_hash != replay.header.final_hash) {
+        DS_LOG_ERROR("the final world differs from the recording");
+        result = 1;
+    }
+
+    if (options.record_path != NULL &&
+        input_log_write(&record, options.record_path, ticks, final_hash) != 0) {
+        result = 1;
+    }
+
+defer:
+    if (script.data != NULL) {
+        ds_io_unmap_file(&script);
+    }
+    input_log_free(&replay);
+    input_log_free(&record);
+    return result;
+}
+
+typedef struct input {
+    char last_key;
+} input_t;
+
+#define LOOP_TICK_MS 160
+#define LOOP_FRAME_MS 33
+#define LOOP_MAX_CATCH_UP 4
+
+typedef struct loop_stats {
+    unsigned int ticks;
+    unsigned int late_ticks;    // ticks run to catch up, after their due time
+    unsigned int skipped_ticks; // ticks dropped because the loop fell too far behind
+    unsigned int frames;
+    unsigned int dropped_frames; // frame deadlines that passed without a frame
+} loop_stats;
+
+void *input_thread(void *arg) {
+    input_t *input = (input_t *)arg;
+
+    for (;;) {
+        // The main loop takes the key with an atomic exchange
+        char key = (char)getchar();
+        __atomic_store_n(&input->last_key, key, __ATOMIC_RELEASE);
+
+        if (key == QUIT_KEY) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// What the simulation knows about the next frame
+typedef struct frame_state {
+    int dirty;              // the world changed since the last snapshot
+    uint64_t tiles_version; // bumped every time a tile changes
+} frame_state;
+
+void frame_on_commit(world_t *world, const world_journal *journal, void *user) {
+    (void)world;
+    frame_state *state = (frame_state *)user;
+
+    if (journal->changes.count > 0) {
+        state->dirty = 1;
+    }
+
+    for (unsigned int i = 0; i < journal->changes.count; i++) {
+        const world_change *change = (const world_change *)journal->changes.items + i;
+        if (change->kind == WORLD_CHANGE_TILE) {
+            state->tiles_version++;
+            break;
+        }
+    }
+}
+
+// TRIPLE BUFFER
+//
+// Three snapshots are shared between the simulation and the render thread.
+// The simulation fills the back snapshot and swaps it with the middle one. The
+// renderer swaps the middle snapshot with its front one when a newer snapshot
+// was published. Both swaps are a single atomic exchange, so neither side
+// waits for the other, and the renderer always gets the latest snapshot.
+#define TRIPLE_BUFFER_FRESH 4 // set in middle when it was not taken yet
+#define TRIPLE_BUFFER_INDEX 3
+
+typedef struct triple_buffer {
+    world_snapshot snapshots[3];
+    unsigned int back;   // only used by the simulation
+    unsigned int middle; // shared, with TRIPLE_BUFFER_FRESH
+    unsigned int front;  // only used by the renderer
+} triple_buffer;
+
+void triple_buffer_init(triple_buffer *buffer) {
+    for (unsigned int i = 0; i < 3; i++) {
+        world_snapshot_init(&buffer->snapshots[i]);
+    }
+    buffer->back = 0;
+    buffer->middle = 1;
+    buffer->front = 2;
+}
+
+world_snapshot *triple_buffer_back(triple_buffer *buffer) {
+    return &buffer->snapshots[buffer->back];
+}
+
+// Hand the back snapshot over to the renderer
+void triple_buffer_publish(triple_buffer *buffer) {
+    unsigned int fresh = buffer->back | TRIPLE_BUFFER_FRESH;
+    buffer->back = __atomic_exchange_n(&buffer->middle, fresh, __ATOMIC_ACQ_REL) &
+                   TRIPLE_BUFFER_INDEX;
+}
+
+// Take the latest snapshot
+//
+// Returns NULL if nothing was published since the last call
+world_snapshot *triple_buffer_acquire(triple_buffer *buffer) {
+    if ((__atomic_load_n(&buffer->middle, __ATOMIC_ACQUIRE) & TRIPLE_BUFFER_FRESH) == 0) {
+        return NULL;
+    }
+
+    buffer->front = __atomic_exchange_n(&buffer->middle, buffer->front, __ATOMIC_ACQ_REL) &
+                    TRIPLE_BUFFER_INDEX;
+    return &buffer->snapshots[buffer->front];
+}
+
+void triple_buffer_free(triple_buffer *buffer) {
+    for (unsigned int i = 0; i < 3; i++) {
+        world_snapshot_free(&buffer->snapshots[i]);
+    }
+}
+
+typedef struct renderer {
+    triple_buffer *buffer;
+    unsigned int frame_ms;
+    int running;
+    int crlf;          // end the lines with CR-LF, for a terminal in raw mode
+    loop_stats *stats; // frames and dropped_frames are written by the renderer
+} renderer;
+
+// Print the latest snapshot every frame period. Writing to the terminal can
+// take long, for example over a slow connection, but only this thread waits.
+void *render_thread(void *arg) {
+    renderer *r = (renderer *)arg;
+    // The frame is built in memory and written at once. The builder keeps its
+    // memory between frames, so rendering does not allocate once warmed up.
+    ds_string_builder frame;
+    ds_string_builder_init(&frame);
+    ds_string_builder lines; // the frame with CR-LF line endings
+    ds_string_builder_init(&lines);
+
+    double frame_seconds = r->frame_ms / 1000.0;
+    double next_frame = clock_seconds();
+    for (;;) {
+        // The flag is read first, so the last published snapshot is still
+        // printed after the simulation stopped
+        int running = __atomic_load_n(&r->running, __ATOMIC_ACQUIRE);
+        world_snapshot *snapshot = triple_buffer_acquire(r->buffer);
+        if (snapshot != NULL) {
+            ds_string_builder_clear(&frame);
+            ds_sb_append_literal(&frame, CLEAR_SCREEN_ANSI);
+            world_snapshot_print(&frame, snapshot);
+
+            const char *data = frame.items.items;
+            unsigned int length = frame.items.count;
+            if (r->crlf) {
+                ds_string_builder_clear(&lines);
+                for (unsigned int begin = 0, i = 0; i <= frame.items.count; i++) {
+                    if (i == frame.items.count || data[i] == '\n') {
+                        ds_string_builder_appendn(&lines, data + begin, i - begin);
+                        if (i < frame.items.count) {
+                            ds_sb_append_literal(&lines, "\r\n");
+                        }
+                        begin = i + 1;
+                    }
+                }
+                data = lines.items.items;
+                length = lines.items.count;
+            }
+
+            fwrite(data, 1, length, stdout);
+            fflush(stdout);
+            r->stats->frames++;
+        }
+
+        if (!running) {
+            break;
+        }
+
+        next_frame += frame_seconds;
+        double now = clock_seconds();
+        if (now > next_frame) {
+            unsigned int missed = (unsigned int)((now - next_frame) / frame_seconds) + 1;
+            r->stats->dropped_frames += missed;
+            next_frame += missed * frame_seconds;
+        }
+        usleep((useconds_t)((next_frame - now) * 1e6));
+    }
+
+    ds_string_builder_free(&frame);
+    ds_string_builder_free(&lines);
+    return NULL;
+}
+
+#ifdef DS_AL_STATS
+void write_alloc_report(const char *path) {
+    ds_string_builder sb;
+    ds_string_builder_init(&sb);
+
+    char *report = NULL;
+    if (ds_allocator_stats_report(&sb, NULL) != 0 ||
+        ds_string_builder_build(&sb, &report) != 0) {
+        DS_PANIC("buy more ram");
+    }
+
+    if (ds_io_write_file(path, report, "w") != 0) {
+        DS_LOG_ERROR("failed to write the allocation report!");
+    }
+
+    DS_FREE(NULL, report);
+    ds_string_builder_free(&sb);
+}
+#endif
+
+int main(int argc, char **argv) {
+    ds_argparse_parser parser;
+    ds_argparse_parser_init(&parser, "main", "A rogue game using ascii for the UI",
+                            "0.1.0");
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'm',
+                                       .long_name = "map",
+                                       .description = "the map to play, as text or .rmap",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'c',
+                                       .long_name = "compile",
+                                       .description = "compile the map to this .rmap file and exit",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'r',
+                                       .long_name = "regions",
+                                       .description = "store region labels in the compiled map",
+                                       .type = ARGUMENT_TYPE_FLAG,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'k',
+                                       .long_name = "chunks",
+                                       .description = "write the map to this chunked file, which is streamed from disk, and exit",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'H',
+                                       .long_name = "headless",
+                                       .description = "run the simulation without rendering and report its speed",
+                                       .type = ARGUMENT_TYPE_FLAG,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 't',
+                                       .long_name = "ticks",
+                                       .description = "number of ticks to simulate in headless mode (default 1000)",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 's',
+                                       .long_name = "seed",
+                                       .description = "seed of the random input in headless mode (default 1)",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'i',
+                                       .long_name = "input",
+                                       .description = "input script for headless mode, one key per tick",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'R',
+                                       .long_name = "record",
+                                       .description = "record the input of the session to this log",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'p',
+                                       .long_name = "replay",
+                                       .description = "replay an input log headless and check it against the recording",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'T',
+                                       .long_name = "tick-ms",
+                                       .description = "milliseconds between two simulation ticks (default 160)",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'F',
+                                       .long_name = "frame-ms",
+                                       .description = "milliseconds between two rendered frames (default 33)",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'j',
+                                       .long_name = "jobs",
+                                       .description = "threads that run the per-tick systems (default one per core)",
+                                       .type = ARGUMENT_TYPE_VALUE,
+                                       .required = 0});
+    ds_argparse_add_argument(
+        &parser, (ds_argparse_options){.short_name = 'v',
+                                       .long_name = "fov",
+                                       .description = "only show the tiles the player can see or has seen",
+                                       .type = ARGUMENT_TYPE_FLAG,
+                                       .required = 0});
+    if (ds_argparse_parse(&parser, argc, argv) != 0) {
+        return 1;
+    }
+
+    char *map_path = ds_argparse_get_value(&parser, "map");
+    if (map_path == NULL) {
+        map_path = WORLD_FILE;
+    }
+
+    world_t world;
+    if (world_load(map_path, &world) != 0) {
+        DS_PANIC("failed to read the map!");
+    }
+
+    char *compile_path = ds_argparse_get_value(&parser, "compile");
+    if (compile_path != NULL) {
+        int result = world_compile(&world, map_path, compile_path,
+                                   ds_argparse_get_flag(&parser, "regions"));
+        world_free(&world);
+        ds_argparse_parser_free(&parser);
+        return result;
+    }
+
+    char *chunks_path = ds_argparse_get_value(&parser, "chunks");
+    if (chunks_path != NULL) {
+        int result = world_write_chunks(&world, chunks_path);
+        world_free(&world);
+        ds_argparse_parser_free(&parser);
+        return result;
+    }
+
+    char *tick_value = ds_argparse_get_value(&parser, "tick-ms");
+    char *frame_value = ds_argparse_get_value(&parser, "frame-ms");
+    unsigned int tick_ms = tick_value != NULL ? strtoul(tick_value, NULL, 10) : LOOP_TICK_MS;
+    unsigned int frame_ms = frame_value != NULL ? strtoul(frame_value, NULL, 10) : LOOP_FRAME_MS;
+    if (tick_ms == 0 || frame_ms == 0) {
+        DS_LOG_ERROR("the tick and frame periods must be at least 1 ms");
+        world_free(&world);
+        ds_argparse_parser_free(&parser);
+        return 1;
+    }
+
+    char *jobs_value = ds_argparse_get_value(&parser, "jobs");
+    job_system jobs;
+    job_system_init(&jobs, jobs_value != NULL ? strtoul(jobs_value, NULL, 10) : 0);
+    world.jobs = &jobs;
+
+    char *record_path = ds_argparse_get_value(&parser, "record");
+    char *replay_path = ds_argparse_get_value(&parser, "replay");
+    if (ds_argparse_get_flag(&parser, "headless") || replay_path != NULL) {
+        char *ticks = ds_argparse_get_value(&parser, "ticks");
+        char *seed = ds_argparse_get_value(&parser, "seed");
+        headless_options options = {
+            .ticks = ticks != NULL ? strtoul(ticks, NULL, 10) : 1000,
+            .seed = seed != NULL ? strtoull(seed, NULL, 10) : 1,
+            .script_path = ds_argparse_get_value(&parser, "input"),
+            .record_path = record_path,
+            .replay_path = replay_path };
+
+        int result = run_headless(&world, options);
+        world_free(&world);
+        job_system_free(&jobs);
+        ds_argparse_parser_free(&parser);
+#ifdef DS_AL_STATS
+        write_alloc_report(ALLOC_REPORT_FILE);
+#endif
+        return result;
+    }
+
+    // A snapshot is only taken after a tick that changed the world
+    frame_state frame = { .dirty = 1, .tiles_version = 0 };
+    world_journal_subscribe(&world, frame_on_commit, &frame);
+
+    int fov = ds_argparse_get_flag(&parser, "fov");
+    viewport view;
+    viewport_resize(&view);
+    struct sigaction resize = { .sa_handler = terminal_on_resize, .sa_flags = SA_RESTART };
+    sigemptyset(&resize.sa_mask);
+    sigaction(SIGWINCH, &resize, NULL);
+
+    loop_stats stats = {0};
+    triple_buffer buffer;
+    triple_buffer_init(&buffer);
+    renderer render = { .buffer = &buffer, .frame_ms = frame_ms, .running = 1,
+                        .crlf = terminal_raw() == 0, .stats = &stats };
+    pthread_t render_thread_id;
+    pthread_create(&render_thread_id, NULL, render_thread, &render);
+
+    input_t input = { .last_key = 0 };
+    pthread_t input_thread_id;
+    pthread_create(&input_thread_id, NULL, input_thread, &input);
+
+    // The input of every tick is recorded with the running journal hash, so
+    // that the session can be replayed with --replay
+    input_log record;
+    uint64_t journal_hash = 0;
+    uint32_t tick = 0;
+    if (record_path != NULL) {
+        journal_hash = world_hash(&world);
+        world_journal_subscribe(&world, journal_hash_on_commit, &journal_hash);
+        input_log_init(&record, journal_hash);
+    }
+
+    // The simulation steps at a fixed rate. Time that passes is added to an
+    // accumulator and a tick is run for every tick period in it, but at most
+    // LOOP_MAX_CATCH_UP in a row; the rest of the backlog is dropped. Frames
+    // are printed by the render thread on their own period, from the snapshots
+    // published here, and a frame whose deadline has passed is skipped.
+    double tick_seconds = tick_ms / 1000.0;
+    double previous = clock_seconds();
+    double accumulator = tick_seconds; // the first tick runs right away
+    int running = 1;
+
+    while (running) {
+        double now = clock_seconds();
+        accumulator += now - previous;
+        previous = now;
+
+        unsigned int steps = 0;
+        while (running && accumulator >= tick_seconds && steps < LOOP_MAX_CATCH_UP) {
+            // The key is taken once per tick, so the whole tick sees the same key
+            char key = __atomic_exchange_n(&input.last_key, 0, __ATOMIC_ACQ_REL);
+
+            // update
+            world_stream(&world);
+            if (key == QUIT_KEY) {
+                if (record_path != NULL) {
+                    input_log_record(&record, tick, key, journal_hash);
+                }
+                running = 0;
+                break;
+            }
+            handle_input(&world, key);
+            if (key != 0) {
+                world_update_enemies(&world);
+            }
+
+            world_journal_commit(&world);
+            if (record_path != NULL && key != 0) {
+                input_log_record(&record, tick, key, journal_hash);
+            }
+            tick++;
+
+#ifdef DS_AL_STATS
+            ds_allocator_stats_tick();
+#endif
+
+            accumulator -= tick_seconds;
+            stats.ticks++;
+            stats.late_ticks += (steps > 0);
+            steps++;
+        }
+
+        if (running && accumulator >= tick_seconds) {
+            unsigned int behind = (unsigned int)(accumulator / tick_seconds);
+            stats.skipped_ticks += behind;
+            accumulator -= behind * tick_seconds;
+        }
+
+        if (terminal_resized) {
+            terminal_resized = 0;
+            viewport_resize(&view);
+            frame.dirty = 1;
+        }
+
+        if (running && frame.dirty) {
+            viewport_follow(&view, &world);
+            world_snapshot_take(triple_buffer_back(&buffer), &world, view, frame.tiles_version,
+                                fov);
+            triple_buffer_publish(&buffer);
+            frame.dirty = 0;
+        }
+
+        // Sleep until the next tick is due
+        double next_tick = previous + (tick_seconds - accumulator);
+        now = clock_seconds();
+        if (running && next_tick > now) {
+            usleep((useconds_t)((next_tick - now) * 1e6));
+        }
+    }
+
+    __atomic_store_n(&render.running, 0, __ATOMIC_RELEASE);
+    pthread_join(render_thread_id, NULL);
+    terminal_restore();
+
+    DS_LOG_INFO("ticks: %u (late %u, skipped %u), frames: %u (dropped %u)",
+                stats.ticks, stats.late_ticks, stats.skipped_ticks, stats.frames,
+                stats.dropped_frames);
+
+    pthread_join(input_thread_id, NULL);
+
+    if (record_path != NULL) {
+        input_log_write(&record, record_path, tick, world_hash(&world));
+        input_log_free(&record);
+    }
+
+    triple_buffer_free(&buffer);
+    world_free(&world);
+    job_system_free(&jobs);
+    ds_argparse_parser_free(&parser);
+
+#ifdef DS_AL_STATS
+    write_alloc_report(ALLOC_REPORT_FILE);
+#endif
 
     return 0;
 }